@@ -0,0 +1,63 @@
+/*
+ * SO2 - Block device drivers lab (#7)
+ * Linux - Exercise #1, #2, #3, #6 (RAM Disk)
+ *
+ * Header file shared with user space.
+ */
+
+#ifndef __RAM_DISK_H__
+#define __RAM_DISK_H__
+
+#include <linux/types.h>
+#include <asm/ioctl.h>
+
+/* write the allocated pages of the disk to its snapshot file */
+#define MY_IOCTL_SNAPSHOT	_IO('r', 1)
+
+#define MY_SNAP_MAGIC		0x4d59424bU	/* "MYBK" */
+#define MY_SNAP_VERSION		1
+
+/*
+ * Snapshot file layout: a header followed by extents. Each extent header
+ * is followed by the data of nr_pages consecutive pages; pages that were
+ * never written are not stored.
+ */
+struct my_snap_header {
+	__u32 magic;
+	__u32 version;
+	__u32 page_size;
+	__u32 reserved;
+	__u64 nr_sectors;
+	__u64 nr_pages;
+};
+
+struct my_snap_extent {
+	__u64 index;		/* first page, in page_size units */
+	__u64 nr_pages;
+};
+
+/*
+ * Zoned mode: explicit zone state changes. The argument points to a
+ * __u64 holding any sector of the zone.
+ */
+#define MY_IOCTL_ZONE_OPEN	_IOW('r', 2, __u64)
+#define MY_IOCTL_ZONE_CLOSE	_IOW('r', 3, __u64)
+#define MY_IOCTL_ZONE_FINISH	_IOW('r', 4, __u64)
+
+/* largest payload accepted by MY_IOCTL_ZONE_APPEND */
+#define MY_ZONE_APPEND_MAX	(1U << 20)
+
+/*
+ * Zone append: write len bytes from buf at the write pointer of the zone
+ * holding sector. On return sector is where the data was written.
+ */
+struct my_zone_append {
+	__u64 sector;
+	__u64 buf;
+	__u32 len;		/* multiple of 512 */
+	__u32 reserved;
+};
+
+#define MY_IOCTL_ZONE_APPEND	_IOWR('r', 5, struct my_zone_append)
+
+#endif /* __RAM_DISK_H__ */
@@ -11,7 +11,28 @@
 #include <linux/fs.h>
 #include <linux/blkdev.h>
 #include <linux/bio.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/crypto.h>
+#include <linux/zsmalloc.h>
+#include <linux/file.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/bitmap.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include "../include/ram-disk.h"
 
 MODULE_DESCRIPTION("Simple RAM Disk");
 MODULE_AUTHOR("SO2");
@@ -22,145 +43,2260 @@ MODULE_LICENSE("GPL");
 
 #define MY_BLOCK_MAJOR		240
 #define MY_BLKDEV_NAME		"mybdev"
-#define MY_BLOCK_MINORS		1
+#define MODULE_NAME		"ram-disk"
+/* minors per disk, the first one is the whole disk */
+#define MY_BLOCK_MINORS		16
+#define MY_MAX_DEVICES		(MINORMASK / MY_BLOCK_MINORS + 1)
 #define NR_SECTORS		128
 
 #define KERNEL_SECTOR_SIZE	512
 
-/* Use bios for read/write requests */
-#define USE_BIO_TRANSFER	1
+/* backing pages are indexed by page offset in the disk */
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)
 
+/* huge backing pages are 2 MiB compound pages */
+#define MY_HPAGE_ORDER		(21 - PAGE_SHIFT)
+#define MY_HPAGE_PAGES		(1UL << MY_HPAGE_ORDER)
+#define MY_HPAGE_SIZE		(PAGE_SIZE << MY_HPAGE_ORDER)
+#define MY_HPAGE_SECTORS	(MY_HPAGE_PAGES << PAGE_SECTORS_SHIFT)
 
-static struct my_block_dev {
-	spinlock_t lock;
+/* values for the queue_mode parameter */
+#define MY_QUEUE_MODE_BIO	0
+#define MY_QUEUE_MODE_MQ	1
+
+static int queue_mode = MY_QUEUE_MODE_MQ;
+module_param(queue_mode, int, 0444);
+MODULE_PARM_DESC(queue_mode, "I/O entry point: 0 = bio-based, 1 = blk-mq");
+
+static int nr_devices = 1;
+module_param(nr_devices, int, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of independent RAM disks to create");
+
+static unsigned long nr_sectors = NR_SECTORS;
+module_param(nr_sectors, ulong, 0444);
+MODULE_PARM_DESC(nr_sectors, "Disk capacity in 512-byte sectors");
+
+static bool compress;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Store pages compressed in a zsmalloc pool");
+
+static char *comp_alg = "lzo";
+module_param(comp_alg, charp, 0444);
+MODULE_PARM_DESC(comp_alg, "Compression algorithm used when compress=1");
+
+static char *snapshot_dir;
+module_param(snapshot_dir, charp, 0444);
+MODULE_PARM_DESC(snapshot_dir, "Directory holding the myblockN.snap files");
+
+static bool restore;
+module_param(restore, bool, 0444);
+MODULE_PARM_DESC(restore, "Lazily restore each disk from its snapshot file");
+
+/* values for the numa_policy parameter */
+#define MY_NUMA_DEFAULT		0
+#define MY_NUMA_BIND		1
+#define MY_NUMA_INTERLEAVE	2
+#define MY_NUMA_LOCAL		3
+
+static int numa_policy = MY_NUMA_DEFAULT;
+module_param(numa_policy, int, 0444);
+MODULE_PARM_DESC(numa_policy, "Backing page placement: 0 = default, "
+		"1 = bind to numa_node, 2 = interleave in numa_stripe_kb "
+		"stripes, 3 = node of the first writer");
+
+static int numa_node = NUMA_NO_NODE;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "Node used by numa_policy=1");
+
+static unsigned int numa_stripe_kb = 2048;
+module_param(numa_stripe_kb, uint, 0444);
+MODULE_PARM_DESC(numa_stripe_kb, "Stripe size used by numa_policy=2");
+
+static bool huge_pages;
+module_param(huge_pages, bool, 0444);
+MODULE_PARM_DESC(huge_pages, "Back the disk with 2 MiB compound pages, "
+		"falling back to 4K pages when they are short");
+
+static int hw_queue_depth = 128;
+module_param(hw_queue_depth, int, 0444);
+MODULE_PARM_DESC(hw_queue_depth, "Number of tags in each hardware queue");
+
+static bool zoned;
+module_param(zoned, bool, 0444);
+MODULE_PARM_DESC(zoned, "Emulate a host-managed zoned block device");
+
+static unsigned int zone_size_mb = 256;
+module_param(zone_size_mb, uint, 0444);
+MODULE_PARM_DESC(zone_size_mb, "Zone size in MiB, a power of two");
+
+static unsigned int zone_nr_conv = 1;
+module_param(zone_nr_conv, uint, 0444);
+MODULE_PARM_DESC(zone_nr_conv, "Number of conventional zones at the start of the disk");
+
+/* values for the lat_profile parameter */
+#define MY_LAT_NONE		0
+#define MY_LAT_HDD		1
+#define MY_LAT_SATA_SSD		2
+#define MY_LAT_NVME		3
+
+static int lat_profile = MY_LAT_NONE;
+module_param(lat_profile, int, 0444);
+MODULE_PARM_DESC(lat_profile, "Emulated device class: 0 = none, 1 = HDD, "
+		"2 = SATA SSD, 3 = NVMe; the lat_* parameters override it "
+		"when non-zero");
+
+static unsigned long lat_base_ns;
+module_param(lat_base_ns, ulong, 0444);
+MODULE_PARM_DESC(lat_base_ns, "Fixed latency added to every request");
+
+static unsigned long lat_ns_per_kb;
+module_param(lat_ns_per_kb, ulong, 0444);
+MODULE_PARM_DESC(lat_ns_per_kb, "Transfer cost of each KiB on one channel");
+
+static unsigned int lat_channels;
+module_param(lat_channels, uint, 0444);
+MODULE_PARM_DESC(lat_channels, "Transfers serviced in parallel, "
+		"beyond that requests queue");
+
+static unsigned int lat_spike_ppm;
+module_param(lat_spike_ppm, uint, 0444);
+MODULE_PARM_DESC(lat_spike_ppm, "Requests per million that see a latency spike");
+
+static unsigned long lat_spike_ns;
+module_param(lat_spike_ns, ulong, 0444);
+MODULE_PARM_DESC(lat_spike_ns, "Extra latency of a spike");
+
+
+/* latency histogram bucket i counts I/Os that took [2^(i-1), 2^i) ns */
+#define MY_LAT_BUCKETS		32
+
+/* per-CPU I/O counters, indexed by direction (0 for read, 1 for write) */
+struct my_block_stats {
+	u64 ops[2];
+	u64 bytes[2];
+	u64 merges[2];
+	u64 errors[2];
+	u64 lat_hist[2][MY_LAT_BUCKETS];
+};
+
+/* hashed per-page locks for the compressed store */
+#define MY_ZLOCKS		64
+
+/* a compressed page; len == 0 means every word of the page is handle */
+struct my_zpage {
+	unsigned long handle;
+	unsigned int len;
+};
+
+/* allocations my_zstore could not make without sleeping, made for a retry */
+struct my_zspare {
+	unsigned long handle;
+	unsigned int len;
+	struct my_zpage *zp;
+};
+
+/* per-CPU compression context, shared by all disks */
+struct my_zstream {
+	struct crypto_comp *tfm;
+	/* compressor output, lzo may expand incompressible data */
+	u8 *cbuf;
+	/* whole uncompressed page for partial reads and writes */
+	u8 *pbuf;
+};
+
+static struct my_zstream __percpu *zstreams;
+
+/* pages copied at once when writing or restoring a snapshot */
+#define MY_SNAP_BATCH		64
+
+/* a run of pages in the snapshot being restored */
+struct my_restore_extent {
+	pgoff_t index;
+	pgoff_t nr_pages;
+	loff_t pos;		/* file offset of the first page */
+};
+
+/* an emulated zone; info is what a zone report returns */
+struct my_zone {
+	/* serializes writes to the zone and its state changes */
+	struct mutex lock;
+	struct blk_zone info;
+};
+
+/* service time model, resolved from the lat_* parameters at load time */
+struct my_lat_model {
+	u64 base_ns;
+	u64 ns_per_kb;
+	unsigned int channels;
+	unsigned int spike_ppm;
+	u64 spike_ns;
+};
+
+/* rough figures for each class; bandwidth is channels KiB per ns_per_kb */
+static const struct my_lat_model my_lat_profiles[] = {
+	[MY_LAT_NONE] = { },
+	/* 4 ms seek and rotation, 200 MB/s, one head */
+	[MY_LAT_HDD] = {
+		.base_ns = 4000000, .ns_per_kb = 5000, .channels = 1,
+		.spike_ppm = 1000, .spike_ns = 30000000,
+	},
+	/* 50 us, 4 channels of ~140 MB/s */
+	[MY_LAT_SATA_SSD] = {
+		.base_ns = 50000, .ns_per_kb = 7400, .channels = 4,
+		.spike_ppm = 100, .spike_ns = 2000000,
+	},
+	/* 10 us, 16 channels of ~210 MB/s */
+	[MY_LAT_NVME] = {
+		.base_ns = 10000, .ns_per_kb = 4800, .channels = 16,
+		.spike_ppm = 10, .spike_ns = 1000000,
+	},
+};
+
+static struct my_lat_model lat;
+static bool lat_enabled;
+
+/*
+ * Polled requests are completed by my_poll once their deadline passes;
+ * their timer only fires this late, for submitters that never poll.
+ */
+#define MY_POLL_SLACK_NS	(10 * NSEC_PER_MSEC)
+
+/* per-request data, completions are delayed by a timer */
+struct my_cmd {
+	struct hrtimer timer;
+	u64 start;
+	u64 deadline;
+	int err;
+};
+
+struct my_block_dev {
+	struct blk_mq_tag_set tag_set;
 	struct request_queue *queue;
 	struct gendisk *gd;
-	u8 *data;
-	size_t size;
-} g_dev;
+	/* serializes page insertion; lookups only need RCU */
+	spinlock_t lock;
+	struct radix_tree_root pages;
+	/* huge pages by 2 MiB index, never overlapping the 4K pages */
+	struct radix_tree_root hpages;
+	atomic_long_t nr_hpages;
+	sector_t nr_sectors;
+	struct my_block_stats __percpu *stats;
+	struct dentry *debugfs_dir;
+	/* compressed store, used instead of pages when compress=1 */
+	struct radix_tree_root zpages;
+	spinlock_t zlocks[MY_ZLOCKS];
+	struct zs_pool *zpool;
+	atomic64_t nr_zpages;
+	atomic64_t nr_same_pages;
+	atomic64_t compr_bytes;
+	/* snapshot file and lazy restore state, protected by snap_lock */
+	struct mutex snap_lock;
+	struct file *restore_file;
+	struct my_restore_extent *extents;
+	unsigned int nr_extents;
+	unsigned long *restore_pending;
+	atomic_long_t nr_restore_pending;
+	u8 *restore_buf;
+	struct task_struct *restore_thread;
+	/* backing pages allocated on each node */
+	atomic_long_t node_pages[MAX_NUMNODES];
+	/* zoned mode, all zones but the last have 1 << zone_shift sectors */
+	struct my_zone *zones;
+	unsigned int nr_zones;
+	unsigned int zone_shift;
+	/* latency emulation: when each channel is done with its transfers */
+	spinlock_t lat_lock;
+	u64 *lat_busy;
+};
+
+static struct my_block_dev *devices;
+static struct dentry *my_debugfs_root;
+
+static int my_block_open(struct block_device *bdev, fmode_t mode)
+{
+	return 0;
+}
+
+static void my_block_release(struct gendisk *gd, fmode_t mode)
+{
+}
+
+static int my_block_ioctl(struct block_device *bdev, fmode_t mode,
+		unsigned int cmd, unsigned long arg);
+
+static const struct block_device_operations my_block_ops = {
+	.owner = THIS_MODULE,
+	.open = my_block_open,
+	.release = my_block_release,
+	.ioctl = my_block_ioctl,
+};
+
+static int my_restore_range(struct my_block_dev *dev, sector_t sector,
+		sector_t nr_sects);
+
+/* Head of the huge page backing page idx, called under RCU */
+static struct page *my_lookup_hpage(struct my_block_dev *dev, pgoff_t idx)
+{
+	if (!huge_pages)
+		return NULL;
+
+	return radix_tree_lookup(&dev->hpages, idx >> MY_HPAGE_ORDER);
+}
+
+/* Backing page idx, possibly a subpage of a huge page, called under RCU */
+static struct page *__my_lookup_page(struct my_block_dev *dev, pgoff_t idx)
+{
+	struct page *head = my_lookup_hpage(dev, idx);
+
+	if (head)
+		return head + (idx & (MY_HPAGE_PAGES - 1));
+
+	return radix_tree_lookup(&dev->pages, idx);
+}
+
+static struct page *my_lookup_page(struct my_block_dev *dev, sector_t sector)
+{
+	struct page *page;
+
+	rcu_read_lock();
+	page = __my_lookup_page(dev, sector >> PAGE_SECTORS_SHIFT);
+	rcu_read_unlock();
+
+	return page;
+}
+
+/* Node the backing page idx should live on, or NUMA_NO_NODE for any */
+static int my_page_node(pgoff_t idx)
+{
+	unsigned long stripe;
+	int nid;
+
+	switch (numa_policy) {
+	case MY_NUMA_BIND:
+		return numa_node;
+	case MY_NUMA_INTERLEAVE:
+		stripe = idx / (numa_stripe_kb >> (PAGE_SHIFT - 10));
+		stripe %= num_online_nodes();
+		for_each_online_node(nid)
+			if (stripe-- == 0)
+				return nid;
+		break;
+	case MY_NUMA_LOCAL:
+		return numa_node_id();
+	}
+
+	return NUMA_NO_NODE;
+}
+
+static struct page *my_alloc_page(pgoff_t idx)
+{
+	gfp_t gfp = GFP_NOIO | __GFP_ZERO | __GFP_HIGHMEM;
+	int nid = my_page_node(idx);
+
+	if (nid == NUMA_NO_NODE)
+		return alloc_page(gfp);
+
+	/* a bound disk must not spill to other nodes */
+	if (numa_policy == MY_NUMA_BIND)
+		gfp |= __GFP_THISNODE;
+
+	return alloc_pages_node(nid, gfp, 0);
+}
+
+/*
+ * Back the whole 2 MiB region holding page idx with one compound page.
+ * Returns NULL if none is available or if 4K pages already back part of
+ * the region, in which case the caller falls back to a 4K page.
+ */
+static struct page *my_insert_hpage(struct my_block_dev *dev, pgoff_t idx)
+{
+	pgoff_t hidx = idx >> MY_HPAGE_ORDER;
+	/* lowmem only, so the region is contiguous in the kernel mapping */
+	gfp_t gfp = GFP_NOIO | __GFP_ZERO | __GFP_COMP | __GFP_NORETRY |
+		__GFP_NOWARN;
+	struct page *head, *small;
+
+	if (numa_policy == MY_NUMA_BIND)
+		gfp |= __GFP_THISNODE;
+	head = alloc_pages_node(my_page_node(idx), gfp, MY_HPAGE_ORDER);
+	if (!head)
+		return NULL;
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		__free_pages(head, MY_HPAGE_ORDER);
+		return NULL;
+	}
+
+	spin_lock(&dev->lock);
+	if (radix_tree_gang_lookup(&dev->pages, (void **)&small,
+				hidx << MY_HPAGE_ORDER, 1) &&
+			small->index < (hidx + 1) << MY_HPAGE_ORDER) {
+		__free_pages(head, MY_HPAGE_ORDER);
+		head = NULL;
+	} else if (radix_tree_insert(&dev->hpages, hidx, head)) {
+		/* somebody else inserted it first */
+		__free_pages(head, MY_HPAGE_ORDER);
+		head = radix_tree_lookup(&dev->hpages, hidx);
+	} else {
+		head->index = hidx;
+		atomic_long_inc(&dev->nr_hpages);
+		atomic_long_add(MY_HPAGE_PAGES,
+				&dev->node_pages[page_to_nid(head)]);
+	}
+	spin_unlock(&dev->lock);
+
+	radix_tree_preload_end();
+
+	return head ? head + (idx & (MY_HPAGE_PAGES - 1)) : NULL;
+}
+
+/* Return the backing page for sector, allocating it on first write */
+static struct page *my_insert_page(struct my_block_dev *dev, sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page, *head;
+
+	page = my_lookup_page(dev, sector);
+	if (page)
+		return page;
+
+	if (huge_pages) {
+		page = my_insert_hpage(dev, idx);
+		if (page)
+			return page;
+	}
+
+	page = my_alloc_page(idx);
+	if (!page)
+		return NULL;
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		__free_page(page);
+		return NULL;
+	}
+
+	spin_lock(&dev->lock);
+	page->index = idx;
+	head = my_lookup_hpage(dev, idx);
+	if (head) {
+		/* a huge page now backs the region */
+		__free_page(page);
+		page = head + (idx & (MY_HPAGE_PAGES - 1));
+	} else if (radix_tree_insert(&dev->pages, idx, page)) {
+		/* somebody else inserted it first */
+		__free_page(page);
+		page = radix_tree_lookup(&dev->pages, idx);
+	} else {
+		atomic_long_inc(&dev->node_pages[page_to_nid(page)]);
+	}
+	spin_unlock(&dev->lock);
+
+	radix_tree_preload_end();
+
+	return page;
+}
+
+static void my_free_page_rcu(struct rcu_head *head)
+{
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+static void my_free_hpage_rcu(struct rcu_head *head)
+{
+	__free_pages(container_of(head, struct page, rcu_head),
+			MY_HPAGE_ORDER);
+}
+
+/* Free the huge page backing the 2 MiB region at sector, if there is one */
+static bool my_delete_hpage(struct my_block_dev *dev, sector_t sector)
+{
+	struct page *head;
+
+	spin_lock(&dev->lock);
+	head = radix_tree_delete(&dev->hpages, sector >> (PAGE_SECTORS_SHIFT +
+				MY_HPAGE_ORDER));
+	spin_unlock(&dev->lock);
+
+	if (!head)
+		return false;
+
+	atomic_long_dec(&dev->nr_hpages);
+	atomic_long_sub(MY_HPAGE_PAGES, &dev->node_pages[page_to_nid(head)]);
+	call_rcu(&head->rcu_head, my_free_hpage_rcu);
+
+	return true;
+}
+
+static void my_delete_page(struct my_block_dev *dev, sector_t sector)
+{
+	struct page *page;
+
+	spin_lock(&dev->lock);
+	page = radix_tree_delete(&dev->pages, sector >> PAGE_SECTORS_SHIFT);
+	spin_unlock(&dev->lock);
+
+	if (page) {
+		atomic_long_dec(&dev->node_pages[page_to_nid(page)]);
+		call_rcu(&page->rcu_head, my_free_page_rcu);
+	}
+}
+
+#define FREE_BATCH		16
+
+static void my_free_pages(struct my_block_dev *dev)
+{
+	struct page *pages[FREE_BATCH];
+	unsigned long pos = 0;
+	int nr_pages, i;
+
+	do {
+		nr_pages = radix_tree_gang_lookup(&dev->pages, (void **)pages,
+				pos, FREE_BATCH);
+		for (i = 0; i < nr_pages; i++) {
+			pos = pages[i]->index;
+			radix_tree_delete(&dev->pages, pos);
+			__free_page(pages[i]);
+		}
+		pos++;
+		cond_resched();
+	} while (nr_pages == FREE_BATCH);
+
+	pos = 0;
+	do {
+		nr_pages = radix_tree_gang_lookup(&dev->hpages, (void **)pages,
+				pos, FREE_BATCH);
+		for (i = 0; i < nr_pages; i++) {
+			pos = pages[i]->index;
+			radix_tree_delete(&dev->hpages, pos);
+			__free_pages(pages[i], MY_HPAGE_ORDER);
+		}
+		pos++;
+		cond_resched();
+	} while (nr_pages == FREE_BATCH);
+}
+
+/*
+ * Allocate the pages touched by a write before the caller maps its
+ * buffer with kmap_atomic, since allocation may sleep.
+ */
+static int my_block_setup(struct my_block_dev *dev, sector_t sector,
+		unsigned long len)
+{
+	unsigned long chunk;
+
+	while (len) {
+		chunk = min_t(unsigned long, len, PAGE_SIZE -
+			((sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT));
+		if (!my_insert_page(dev, sector))
+			return -ENOMEM;
+		sector += chunk >> SECTOR_SHIFT;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static bool my_page_same_filled(const void *ptr, unsigned long *value)
+{
+	const unsigned long *words = ptr;
+	unsigned int pos, last = PAGE_SIZE / sizeof(*words) - 1;
+
+	if (words[0] != words[last])
+		return false;
+
+	for (pos = 1; pos < last; pos++)
+		if (words[pos] != words[0])
+			return false;
+
+	*value = words[0];
+	return true;
+}
+
+/* Drop the data held by zp and its contribution to the statistics */
+static void my_zrelease(struct my_block_dev *dev, struct my_zpage *zp)
+{
+	if (zp->len == 0) {
+		atomic64_dec(&dev->nr_same_pages);
+	} else {
+		zs_free(dev->zpool, zp->handle);
+		atomic64_sub(zp->len, &dev->compr_bytes);
+	}
+}
+
+/* Decompress zp (NULL if never written) into a whole page at dst */
+static int my_zload(struct my_block_dev *dev, struct my_zpage *zp, u8 *dst,
+		struct my_zstream *zs)
+{
+	unsigned int dlen = PAGE_SIZE;
+	void *src;
+	int err = 0;
+
+	if (!zp) {
+		memset(dst, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	if (zp->len == 0) {
+		memset_l((unsigned long *)dst, zp->handle,
+				PAGE_SIZE / sizeof(unsigned long));
+		return 0;
+	}
+
+	src = zs_map_object(dev->zpool, zp->handle, ZS_MM_RO);
+	if (zp->len == PAGE_SIZE)
+		memcpy(dst, src, PAGE_SIZE);
+	else
+		err = crypto_comp_decompress(zs->tfm, src, zp->len, dst, &dlen);
+	zs_unmap_object(dev->zpool, zp->handle);
+
+	return err;
+}
+
+/*
+ * Compress the page at src and store it as page idx, replacing zp if the
+ * page was already present. Called with the page lock held, so nothing
+ * here may sleep: what cannot be allocated at once is left to the caller
+ * in spare, and -EAGAIN asks it to allocate that outside the locks and
+ * call again.
+ */
+static int my_zstore(struct my_block_dev *dev, pgoff_t idx,
+		struct my_zpage *zp, const u8 *src, struct my_zstream *zs,
+		struct my_zspare *spare)
+{
+	unsigned int clen = 2 * PAGE_SIZE;
+	unsigned long handle, value;
+	void *dst;
+	int err;
+
+	if (my_page_same_filled(src, &value)) {
+		clen = 0;
+		handle = value;
+	} else {
+		err = crypto_comp_compress(zs->tfm, src, PAGE_SIZE,
+				zs->cbuf, &clen);
+		if (err)
+			return err;
+
+		/* not worth it, keep the page as is */
+		if (clen >= PAGE_SIZE)
+			clen = PAGE_SIZE;
+
+		/* the data may have changed since the spare was sized */
+		if (spare->handle && spare->len != clen) {
+			zs_free(dev->zpool, spare->handle);
+			spare->handle = 0;
+		}
+		handle = spare->handle;
+		spare->handle = 0;
+		if (!handle)
+			handle = zs_malloc(dev->zpool, clen, GFP_NOWAIT |
+					__GFP_HIGHMEM | __GFP_MOVABLE |
+					__GFP_NOWARN);
+		if (!handle) {
+			spare->len = clen;
+			return -EAGAIN;
+		}
+
+		dst = zs_map_object(dev->zpool, handle, ZS_MM_WO);
+		memcpy(dst, clen == PAGE_SIZE ? src : zs->cbuf, clen);
+		zs_unmap_object(dev->zpool, handle);
+	}
+
+	if (zp) {
+		my_zrelease(dev, zp);
+	} else {
+		zp = spare->zp;
+		spare->zp = NULL;
+		if (!zp)
+			zp = kmalloc(sizeof(*zp), GFP_NOWAIT | __GFP_NOWARN);
+		if (!zp) {
+			/* keep the handle for the retry */
+			if (clen) {
+				spare->handle = handle;
+				spare->len = clen;
+			}
+			return -EAGAIN;
+		}
+		/* the caller preloaded the tree, the insert takes no memory */
+		spin_lock(&dev->lock);
+		err = radix_tree_insert(&dev->zpages, idx, zp);
+		spin_unlock(&dev->lock);
+		if (err) {
+			kfree(zp);
+			if (clen)
+				zs_free(dev->zpool, handle);
+			return err;
+		}
+		atomic64_inc(&dev->nr_zpages);
+	}
+
+	zp->handle = handle;
+	zp->len = clen;
+	if (clen)
+		atomic64_add(clen, &dev->compr_bytes);
+	else
+		atomic64_inc(&dev->nr_same_pages);
+
+	return 0;
+}
+
+/*
+ * Transfer chunk bytes at offset within the page holding sector to or from
+ * the compressed store. A write with a NULL buffer zeroes the range. Writes
+ * first try to allocate without sleeping under the locks; if that fails,
+ * the locks are dropped, the memory is allocated with GFP_NOIO and the
+ * write starts over. May sleep: buffer must not be mapped with kmap_atomic.
+ */
+static int my_zxfer(struct my_block_dev *dev, sector_t sector,
+		unsigned long offset, unsigned long chunk, char *buffer, int dir)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	spinlock_t *lock = &dev->zlocks[idx & (MY_ZLOCKS - 1)];
+	struct my_zspare spare = { };
+	struct my_zstream *zs;
+	struct my_zpage *zp;
+	int err;
+
+retry:
+	if (dir && radix_tree_preload(GFP_NOIO)) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+	err = 0;
+	zs = get_cpu_ptr(zstreams);
+	spin_lock(lock);
+
+	rcu_read_lock();
+	zp = radix_tree_lookup(&dev->zpages, idx);
+	rcu_read_unlock();
+
+	if (dir == 0) {
+		if (chunk == PAGE_SIZE) {
+			err = my_zload(dev, zp, buffer, zs);
+		} else {
+			err = my_zload(dev, zp, zs->pbuf, zs);
+			if (!err)
+				memcpy(buffer, zs->pbuf + offset, chunk);
+		}
+	} else if (chunk == PAGE_SIZE && buffer) {
+		err = my_zstore(dev, idx, zp, buffer, zs, &spare);
+	} else if (zp || buffer) {
+		/* partial write, read-modify-write the whole page */
+		err = my_zload(dev, zp, zs->pbuf, zs);
+		if (!err) {
+			if (buffer)
+				memcpy(zs->pbuf + offset, buffer, chunk);
+			else
+				memset(zs->pbuf + offset, 0, chunk);
+			err = my_zstore(dev, idx, zp, zs->pbuf, zs, &spare);
+		}
+	}
+
+	spin_unlock(lock);
+	put_cpu_ptr(zstreams);
+	if (dir)
+		radix_tree_preload_end();
+
+	if (err == -EAGAIN) {
+		if (!spare.zp)
+			spare.zp = kmalloc(sizeof(*spare.zp), GFP_NOIO);
+		if (spare.len && !spare.handle)
+			spare.handle = zs_malloc(dev->zpool, spare.len,
+					GFP_NOIO | __GFP_HIGHMEM |
+					__GFP_MOVABLE);
+		if (spare.zp && (!spare.len || spare.handle))
+			goto retry;
+		err = -ENOMEM;
+	}
+
+out_free:
+	kfree(spare.zp);
+	if (spare.handle)
+		zs_free(dev->zpool, spare.handle);
+	return err;
+}
+
+static void my_zdelete(struct my_block_dev *dev, sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	spinlock_t *lock = &dev->zlocks[idx & (MY_ZLOCKS - 1)];
+	struct my_zpage *zp;
+
+	spin_lock(lock);
+	spin_lock(&dev->lock);
+	zp = radix_tree_delete(&dev->zpages, idx);
+	spin_unlock(&dev->lock);
+	if (zp) {
+		my_zrelease(dev, zp);
+		atomic64_dec(&dev->nr_zpages);
+	}
+	spin_unlock(lock);
+
+	kfree(zp);
+}
+
+static void my_zfree_pages(struct my_block_dev *dev)
+{
+	struct my_zpage *zps[FREE_BATCH];
+	unsigned long indices[FREE_BATCH];
+	struct radix_tree_iter iter;
+	unsigned long pos = 0;
+	void **slot;
+	int nr, i;
+
+	do {
+		nr = 0;
+		radix_tree_for_each_slot(slot, &dev->zpages, &iter, pos) {
+			indices[nr] = iter.index;
+			zps[nr] = radix_tree_deref_slot(slot);
+			if (++nr == FREE_BATCH)
+				break;
+		}
+		for (i = 0; i < nr; i++) {
+			radix_tree_delete(&dev->zpages, indices[i]);
+			my_zrelease(dev, zps[i]);
+			kfree(zps[i]);
+			pos = indices[i] + 1;
+		}
+		cond_resched();
+	} while (nr == FREE_BATCH);
+
+	zs_destroy_pool(dev->zpool);
+}
+
+static void destroy_zstreams(void)
+{
+	struct my_zstream *zs;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		zs = per_cpu_ptr(zstreams, cpu);
+		if (!IS_ERR_OR_NULL(zs->tfm))
+			crypto_free_comp(zs->tfm);
+		kfree(zs->cbuf);
+		kfree(zs->pbuf);
+	}
+	free_percpu(zstreams);
+}
+
+static int create_zstreams(void)
+{
+	struct my_zstream *zs;
+	int cpu;
+
+	zstreams = alloc_percpu(struct my_zstream);
+	if (!zstreams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		zs = per_cpu_ptr(zstreams, cpu);
+		zs->tfm = crypto_alloc_comp(comp_alg, 0, 0);
+		if (IS_ERR(zs->tfm)) {
+			printk(KERN_ERR "crypto_alloc_comp: no %s support\n",
+					comp_alg);
+			goto out_free;
+		}
+		zs->cbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+		zs->pbuf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!zs->cbuf || !zs->pbuf)
+			goto out_free;
+	}
+
+	return 0;
+
+out_free:
+	destroy_zstreams();
+	return -ENOMEM;
+}
+
+static bool my_hpage_backed(struct my_block_dev *dev, sector_t sector)
+{
+	bool ret;
+
+	rcu_read_lock();
+	ret = my_lookup_hpage(dev, sector >> PAGE_SECTORS_SHIFT) != NULL;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Handle discard and write-zeroes: whole pages in the range go back to the
+ * system, partial pages at the edges are zeroed in place.
+ */
+static int my_block_discard(struct my_block_dev *dev, sector_t sector,
+		sector_t nr_sects)
+{
+	unsigned long offset, chunk;
+	struct page *page;
+	u8 *mem;
+	int err;
+
+	if (sector + nr_sects > dev->nr_sectors)
+		return -EIO;
+
+	/* pages not yet restored would come back after the discard */
+	err = my_restore_range(dev, sector, nr_sects);
+	if (err)
+		return err;
+
+	while (nr_sects) {
+		/* whole huge pages are freed at once */
+		if (huge_pages && !(sector & (MY_HPAGE_SECTORS - 1)) &&
+				nr_sects >= MY_HPAGE_SECTORS &&
+				my_delete_hpage(dev, sector)) {
+			sector += MY_HPAGE_SECTORS;
+			nr_sects -= MY_HPAGE_SECTORS;
+			cond_resched();
+			continue;
+		}
+
+		offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		chunk = PAGE_SIZE - offset;
+		if (nr_sects < (chunk >> SECTOR_SHIFT))
+			chunk = nr_sects << SECTOR_SHIFT;
+
+		if (compress) {
+			if (chunk == PAGE_SIZE) {
+				my_zdelete(dev, sector);
+			} else {
+				err = my_zxfer(dev, sector, offset, chunk,
+						NULL, 1);
+				if (err)
+					return err;
+			}
+		} else if (chunk == PAGE_SIZE && !my_hpage_backed(dev, sector)) {
+			my_delete_page(dev, sector);
+		} else {
+			/* partial page, or a subpage of a huge page */
+			rcu_read_lock();
+			page = __my_lookup_page(dev, sector >> PAGE_SECTORS_SHIFT);
+			if (page) {
+				mem = kmap_atomic(page);
+				memset(mem + offset, 0, chunk);
+				kunmap_atomic(mem);
+			}
+			rcu_read_unlock();
+		}
+
+		sector += chunk >> SECTOR_SHIFT;
+		nr_sects -= chunk >> SECTOR_SHIFT;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Transfer at most len bytes starting at sector from or to the backing
+ * store. A huge page is contiguous in the kernel mapping, so the copy runs
+ * up to the end of it in one go; otherwise it stops at the page boundary.
+ * Returns the number of bytes transferred, or -EAGAIN if the page a write
+ * goes to was discarded meanwhile.
+ */
+static long my_page_xfer(struct my_block_dev *dev, sector_t sector,
+		unsigned long len, char *buffer, int dir)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	unsigned long offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+	unsigned long chunk;
+	struct page *page, *head;
+	u8 *mem;
+
+	/*
+	 * Hold the RCU read lock across the copy so a concurrent
+	 * discard cannot free the page under us.
+	 */
+	rcu_read_lock();
+	head = my_lookup_hpage(dev, idx);
+	if (head) {
+		offset += (idx & (MY_HPAGE_PAGES - 1)) << PAGE_SHIFT;
+		chunk = min_t(unsigned long, len, MY_HPAGE_SIZE - offset);
+		if (dir == 0)
+			memcpy(buffer, page_address(head) + offset, chunk);
+		else
+			memcpy(page_address(head) + offset, buffer, chunk);
+		rcu_read_unlock();
+		return chunk;
+	}
+
+	chunk = min_t(unsigned long, len, PAGE_SIZE - offset);
+	page = radix_tree_lookup(&dev->pages, idx);
+
+	/* Read/write to dev page depending on dir */
+	if (dir == 0) { //read 
+		if (page) {
+			mem = kmap_atomic(page);
+			memcpy(buffer, mem + offset, chunk);
+			kunmap_atomic(mem);
+		} else {
+			/* never written, read back as zeroes */
+			memset(buffer, 0, chunk);
+		}
+	} else if (page) { // write
+		mem = kmap_atomic(page);
+		memcpy(mem + offset, buffer, chunk);
+		kunmap_atomic(mem);
+	}
+	rcu_read_unlock();
+
+	/* write raced with a discard of the same range */
+	if (dir == 1 && !page)
+		return -EAGAIN;
+
+	return chunk;
+}
+
+/*
+ * Copy len bytes at sector between buffer and the backing store. Never
+ * sleeps for the 4K page store: a write that finds one of its pages
+ * discarded since my_block_setup returns -EAGAIN, and the caller sets the
+ * range up again and retries.
+ */
+static int my_block_transfer(struct my_block_dev *dev, sector_t sector,
+		unsigned long len, char *buffer, int dir)
+{
+	unsigned long offset, chunk;
+	long done;
+	int err;
+
+	/* check for read/write beyond end of block device */
+	if (sector + (len >> SECTOR_SHIFT) > dev->nr_sectors)
+		return -EIO;
+
+	if (dir != 0 && dir != 1) {
+		printk(KERN_ERR "invalid transfer direction %d\n", dir);
+		return -EINVAL;
+	}
+
+	while (len) {
+		offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		chunk = min_t(unsigned long, len, PAGE_SIZE - offset);
+
+		if (compress) {
+			err = my_zxfer(dev, sector, offset, chunk, buffer, dir);
+			if (err)
+				return err;
+		} else {
+			done = my_page_xfer(dev, sector, len, buffer, dir);
+			if (done < 0)
+				return done;
+			chunk = done;
+		}
+
+		buffer += chunk;
+		sector += chunk >> SECTOR_SHIFT;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static void my_snapshot_path(struct my_block_dev *dev, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s.snap", snapshot_dir,
+			dev->gd->disk_name);
+}
+
+static int my_snap_write(struct file *file, const void *buf, size_t len,
+		loff_t *pos)
+{
+	ssize_t ret = kernel_write(file, buf, len, pos);
+
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EIO;
+}
+
+static int my_snap_read(struct file *file, void *buf, size_t len,
+		loff_t *pos)
+{
+	ssize_t ret = kernel_read(file, buf, len, pos);
+
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EIO;
+}
+
+/*
+ * Write one extent: its header, then all of its pages in a single write.
+ * The pages are copied out with one transfer, so huge pages are copied in
+ * one go; the part of a last page beyond the disk is stored as zeroes.
+ */
+static int my_snap_write_extent(struct my_block_dev *dev, struct file *file,
+		loff_t *pos, u8 *buf, pgoff_t index, pgoff_t nr_pages)
+{
+	struct my_snap_extent ext = {
+		.index = index,
+		.nr_pages = nr_pages,
+	};
+	sector_t sector = (sector_t)index << PAGE_SECTORS_SHIFT;
+	unsigned long len;
+	int err;
+
+	len = min_t(u64, nr_pages * PAGE_SIZE,
+			(dev->nr_sectors - sector) << SECTOR_SHIFT);
+	err = my_block_transfer(dev, sector, len, buf, 0);
+	if (err)
+		return err;
+	memset(buf + len, 0, nr_pages * PAGE_SIZE - len);
+
+	err = my_snap_write(file, &ext, sizeof(ext), pos);
+	if (err)
+		return err;
+
+	return my_snap_write(file, buf, nr_pages * PAGE_SIZE, pos);
+}
+
+/* Find the first backed page at or after start */
+static bool my_next_index(struct my_block_dev *dev, pgoff_t start,
+		pgoff_t *index)
+{
+	struct radix_tree_root *root = compress ? &dev->zpages : &dev->pages;
+	struct radix_tree_iter iter;
+	bool found = false;
+	pgoff_t first;
+	void **slot;
+
+	rcu_read_lock();
+	radix_tree_for_each_slot(slot, root, &iter, start) {
+		*index = iter.index;
+		found = true;
+		break;
+	}
+	if (huge_pages) {
+		radix_tree_for_each_slot(slot, &dev->hpages, &iter,
+				start >> MY_HPAGE_ORDER) {
+			first = max_t(pgoff_t, iter.index << MY_HPAGE_ORDER,
+					start);
+			if (!found || first < *index)
+				*index = first;
+			found = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
+/*
+ * Stream the allocated pages to <snapshot_dir>/myblockN.snap. Runs of
+ * consecutive pages are written as one extent; the writes go through the
+ * page cache and are only waited for by the final fsync.
+ */
+static int my_snapshot_save(struct my_block_dev *dev)
+{
+	struct my_snap_header hdr = {
+		.magic = MY_SNAP_MAGIC,
+		.version = MY_SNAP_VERSION,
+		.page_size = PAGE_SIZE,
+		.nr_sectors = dev->nr_sectors,
+	};
+	pgoff_t start = 0, nr = 0, next = 0, index;
+	struct file *file;
+	loff_t pos = 0;
+	bool found;
+	char *path;
+	u8 *buf;
+	int err;
+
+	if (!snapshot_dir)
+		return -EINVAL;
+
+	mutex_lock(&dev->snap_lock);
+
+	/* the disk still depends on the previous snapshot file */
+	if (atomic_long_read(&dev->nr_restore_pending)) {
+		err = -EBUSY;
+		goto out_unlock;
+	}
+
+	path = kmalloc(PATH_MAX, GFP_KERNEL);
+	buf = vmalloc(MY_SNAP_BATCH * PAGE_SIZE);
+	if (!path || !buf) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	my_snapshot_path(dev, path);
+	file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+			0600);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_free;
+	}
+
+	/* the page count is rewritten once it is known */
+	err = my_snap_write(file, &hdr, sizeof(hdr), &pos);
+	if (err)
+		goto out_close;
+
+	while (1) {
+		found = my_next_index(dev, next, &index);
+
+		if (nr && (!found || index != start + nr ||
+				nr == MY_SNAP_BATCH)) {
+			err = my_snap_write_extent(dev, file, &pos, buf,
+					start, nr);
+			if (err)
+				goto out_close;
+			hdr.nr_pages += nr;
+			nr = 0;
+		}
+		if (!found)
+			break;
+
+		if (!nr)
+			start = index;
+		nr++;
+		next = index + 1;
+		cond_resched();
+	}
+
+	pos = 0;
+	err = my_snap_write(file, &hdr, sizeof(hdr), &pos);
+	if (!err)
+		err = vfs_fsync(file, 0);
+
+out_close:
+	filp_close(file, NULL);
+out_free:
+	vfree(buf);
+	kfree(path);
+out_unlock:
+	mutex_unlock(&dev->snap_lock);
+	return err;
+}
+
+static struct my_restore_extent *my_restore_extent(struct my_block_dev *dev,
+		pgoff_t idx)
+{
+	unsigned int lo = 0, hi = dev->nr_extents;
+	struct my_restore_extent *ext;
+
+	/* extents are stored in ascending page order */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		ext = &dev->extents[mid];
+		if (idx < ext->index)
+			hi = mid;
+		else if (idx >= ext->index + ext->nr_pages)
+			lo = mid + 1;
+		else
+			return ext;
+	}
+
+	return NULL;
+}
+
+/*
+ * Read back the run of pending pages starting at idx and ending before end
+ * from the snapshot file. The run stays within one extent and is restored
+ * with a single read and a single transfer, at most MY_SNAP_BATCH pages.
+ */
+static int my_restore_run(struct my_block_dev *dev, pgoff_t idx, pgoff_t end)
+{
+	sector_t sector = (sector_t)idx << PAGE_SECTORS_SHIFT;
+	struct my_restore_extent *ext;
+	unsigned long nr, len;
+	loff_t pos;
+	int err = 0;
+
+	mutex_lock(&dev->snap_lock);
+	if (!test_bit(idx, dev->restore_pending))
+		goto out_unlock;
+
+	ext = my_restore_extent(dev, idx);
+	end = min3(end, ext->index + ext->nr_pages, idx + MY_SNAP_BATCH);
+	nr = find_next_zero_bit(dev->restore_pending, end, idx) - idx;
+
+	pos = ext->pos + (idx - ext->index) * PAGE_SIZE;
+	len = min_t(u64, nr * PAGE_SIZE,
+			(dev->nr_sectors - sector) << SECTOR_SHIFT);
+	err = my_snap_read(dev->restore_file, dev->restore_buf, len, &pos);
+	if (err)
+		goto out_unlock;
+
+	if (!compress)
+		err = my_block_setup(dev, sector, len);
+	if (!err)
+		err = my_block_transfer(dev, sector, len, dev->restore_buf, 1);
+	if (err)
+		goto out_unlock;
+
+	/* make the pages visible before the lock-free check can pass */
+	smp_mb__before_atomic();
+	bitmap_clear(dev->restore_pending, idx, nr);
+	if (atomic_long_sub_and_test(nr, &dev->nr_restore_pending)) {
+		fput(dev->restore_file);
+		dev->restore_file = NULL;
+		printk(KERN_INFO "%s: restore complete\n", dev->gd->disk_name);
+	}
+
+out_unlock:
+	mutex_unlock(&dev->snap_lock);
+	return err;
+}
+
+/* Restore the pending pages in a range before it is accessed */
+static int my_restore_range(struct my_block_dev *dev, sector_t sector,
+		sector_t nr_sects)
+{
+	unsigned long idx, end;
+	int err;
+
+	if (!atomic_long_read(&dev->nr_restore_pending))
+		return 0;
+	smp_rmb();
+
+	/* the bitmap covers the partial last page, but not one bit more */
+	idx = sector >> PAGE_SECTORS_SHIFT;
+	end = min_t(unsigned long, DIV_ROUND_UP(sector + nr_sects, PAGE_SECTORS),
+			DIV_ROUND_UP(dev->nr_sectors, PAGE_SECTORS));
+	for (idx = find_next_bit(dev->restore_pending, end, idx);
+			idx < end;
+			idx = find_next_bit(dev->restore_pending, end, idx + 1)) {
+		err = my_restore_run(dev, idx, end);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/* Background restore, racing with on-demand restores from the I/O path */
+static int my_restore_thread(void *data)
+{
+	struct my_block_dev *dev = data;
+	unsigned long nr_pages = DIV_ROUND_UP(dev->nr_sectors, PAGE_SECTORS);
+	unsigned long idx;
+	int err;
+
+	for_each_set_bit(idx, dev->restore_pending, nr_pages) {
+		if (kthread_should_stop())
+			return 0;
+		err = my_restore_run(dev, idx, nr_pages);
+		if (err) {
+			printk(KERN_ERR "%s: restore failed at page %lu (%d)\n",
+					dev->gd->disk_name, idx, err);
+			break;
+		}
+		cond_resched();
+	}
+
+	/* wait for kthread_stop */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+/*
+ * Read the snapshot header and extent list and mark every stored page as
+ * pending. Data is only read later, by the I/O path or the restore thread,
+ * so the extents are checked against the file size here: a truncated
+ * snapshot is rejected rather than failing pages long after the load.
+ */
+static int my_restore_load(struct my_block_dev *dev)
+{
+	unsigned long nr_pages = DIV_ROUND_UP(dev->nr_sectors, PAGE_SECTORS);
+	struct my_restore_extent *extents = NULL, *tmp;
+	unsigned int nr = 0, size = 0;
+	u64 loaded = 0, next = 0;
+	loff_t file_size;
+	struct my_snap_header hdr;
+	struct my_snap_extent ext;
+	struct file *file;
+	loff_t pos = 0;
+	char *path;
+	int err;
+
+	path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	my_snapshot_path(dev, path);
+	file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	kfree(path);
+	if (IS_ERR(file)) {
+		printk(KERN_NOTICE "%s: no snapshot to restore\n",
+				dev->gd->disk_name);
+		return 0;
+	}
+
+	file_size = i_size_read(file_inode(file));
+	err = my_snap_read(file, &hdr, sizeof(hdr), &pos);
+	if (err)
+		goto out_corrupt;
+	if (hdr.magic != MY_SNAP_MAGIC || hdr.version != MY_SNAP_VERSION ||
+			hdr.page_size != PAGE_SIZE ||
+			hdr.nr_sectors != dev->nr_sectors ||
+			hdr.nr_pages > nr_pages) {
+		printk(KERN_ERR "%s: snapshot does not match the disk\n",
+				dev->gd->disk_name);
+		err = -EINVAL;
+		goto out_close;
+	}
+
+	dev->restore_pending = kvcalloc(BITS_TO_LONGS(nr_pages),
+			sizeof(unsigned long), GFP_KERNEL);
+	dev->restore_buf = vmalloc(MY_SNAP_BATCH * PAGE_SIZE);
+	if (!dev->restore_pending || !dev->restore_buf) {
+		err = -ENOMEM;
+		goto out_close;
+	}
+
+	while (loaded < hdr.nr_pages) {
+		err = my_snap_read(file, &ext, sizeof(ext), &pos);
+		if (err)
+			goto out_corrupt;
+		/* ascending and disjoint, my_restore_extent bisects them */
+		if (!ext.nr_pages || ext.index < next || ext.index >= nr_pages ||
+				ext.nr_pages > nr_pages - ext.index ||
+				ext.nr_pages > hdr.nr_pages - loaded ||
+				ext.nr_pages * PAGE_SIZE > file_size - pos)
+			goto out_corrupt;
+
+		if (nr == size) {
+			size = size ? 2 * size : 64;
+			tmp = krealloc(extents, size * sizeof(*extents),
+					GFP_KERNEL);
+			if (!tmp) {
+				err = -ENOMEM;
+				goto out_close;
+			}
+			extents = tmp;
+		}
+		extents[nr].index = ext.index;
+		extents[nr].nr_pages = ext.nr_pages;
+		extents[nr].pos = pos;
+		nr++;
+
+		bitmap_set(dev->restore_pending, ext.index, ext.nr_pages);
+		atomic_long_add(ext.nr_pages, &dev->nr_restore_pending);
+		pos += ext.nr_pages * PAGE_SIZE;
+		loaded += ext.nr_pages;
+		next = ext.index + ext.nr_pages;
+	}
+	if (pos != file_size)
+		goto out_corrupt;
+
+	if (!nr) {
+		err = 0;
+		goto out_close;
+	}
+
+	dev->extents = extents;
+	dev->nr_extents = nr;
+	dev->restore_file = file;
+	printk(KERN_INFO "%s: restoring %ld pages\n", dev->gd->disk_name,
+			atomic_long_read(&dev->nr_restore_pending));
+
+	return 0;
+
+out_corrupt:
+	printk(KERN_ERR "%s: snapshot is truncated or corrupt\n",
+			dev->gd->disk_name);
+	err = -EINVAL;
+out_close:
+	atomic_long_set(&dev->nr_restore_pending, 0);
+	kvfree(dev->restore_pending);
+	dev->restore_pending = NULL;
+	vfree(dev->restore_buf);
+	dev->restore_buf = NULL;
+	kfree(extents);
+	fput(file);
+	return err;
+}
+
+static void my_restore_cleanup(struct my_block_dev *dev)
+{
+	if (dev->restore_file)
+		fput(dev->restore_file);
+	kfree(dev->extents);
+	kvfree(dev->restore_pending);
+	vfree(dev->restore_buf);
+}
+
+static struct my_zone *my_zone_get(struct my_block_dev *dev, sector_t sector)
+{
+	return &dev->zones[sector >> dev->zone_shift];
+}
+
+/* Check a write against its zone. Called with zone->lock held. */
+static int my_zone_check(struct my_zone *zone, sector_t sector,
+		sector_t nr_sects)
+{
+	struct blk_zone *z = &zone->info;
+
+	if (sector + nr_sects > z->start + z->len)
+		return -EIO;
+	if (z->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return 0;
+	if (z->cond == BLK_ZONE_COND_FULL || sector != z->wp)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Move the write pointer past a checked write once its data is copied.
+ * Called with zone->lock held.
+ */
+static void my_zone_advance(struct my_zone *zone, sector_t nr_sects)
+{
+	struct blk_zone *z = &zone->info;
+
+	if (z->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return;
+
+	z->wp += nr_sects;
+	if (z->wp == z->start + z->len)
+		z->cond = BLK_ZONE_COND_FULL;
+	else if (z->cond != BLK_ZONE_COND_EXP_OPEN)
+		z->cond = BLK_ZONE_COND_IMP_OPEN;
+}
+
+/*
+ * Lock the zone a write goes to and check the write against it. The lock
+ * is held until my_zone_write_end so writes land in zone order.
+ */
+static int my_zone_write_begin(struct my_block_dev *dev, sector_t sector,
+		sector_t nr_sects, struct my_zone **zonep)
+{
+	struct my_zone *zone;
+	int err;
+
+	if (sector >= dev->nr_sectors)
+		return -EIO;
+
+	zone = my_zone_get(dev, sector);
+	mutex_lock(&zone->lock);
+	err = my_zone_check(zone, sector, nr_sects);
+	if (err) {
+		mutex_unlock(&zone->lock);
+		return err;
+	}
+
+	*zonep = zone;
+	return 0;
+}
 
-static int my_block_open(struct block_device *bdev, fmode_t mode)
+/* The write pointer only moves if all of the data was copied */
+static void my_zone_write_end(struct my_zone *zone, sector_t nr_sects,
+		int err)
+{
+	if (!err)
+		my_zone_advance(zone, nr_sects);
+	mutex_unlock(&zone->lock);
+}
+
+/* the written part of the zone is discarded, freeing its pages */
+static int my_zone_reset(struct my_block_dev *dev, sector_t sector)
+{
+	struct my_zone *zone;
+	int err;
+
+	if (sector >= dev->nr_sectors)
+		return -EIO;
+
+	zone = my_zone_get(dev, sector);
+	if (zone->info.type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return -EIO;
+
+	mutex_lock(&zone->lock);
+	err = my_block_discard(dev, zone->info.start,
+			zone->info.wp - zone->info.start);
+	if (!err) {
+		zone->info.wp = zone->info.start;
+		zone->info.cond = BLK_ZONE_COND_EMPTY;
+	}
+	mutex_unlock(&zone->lock);
+
+	return err;
+}
+
+/* explicit open, close and finish, requested through ioctls */
+static int my_zone_manage(struct my_block_dev *dev, sector_t sector,
+		unsigned int cmd)
 {
+	struct my_zone *zone;
+	struct blk_zone *z;
+
+	if (sector >= dev->nr_sectors)
+		return -EINVAL;
+
+	zone = my_zone_get(dev, sector);
+	z = &zone->info;
+	if (z->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return -EIO;
+
+	mutex_lock(&zone->lock);
+	switch (cmd) {
+	case MY_IOCTL_ZONE_OPEN:
+		if (z->cond != BLK_ZONE_COND_FULL)
+			z->cond = BLK_ZONE_COND_EXP_OPEN;
+		break;
+	case MY_IOCTL_ZONE_CLOSE:
+		if (z->cond == BLK_ZONE_COND_IMP_OPEN ||
+				z->cond == BLK_ZONE_COND_EXP_OPEN)
+			z->cond = z->wp == z->start ? BLK_ZONE_COND_EMPTY :
+				BLK_ZONE_COND_CLOSED;
+		break;
+	case MY_IOCTL_ZONE_FINISH:
+		z->wp = z->start + z->len;
+		z->cond = BLK_ZONE_COND_FULL;
+		break;
+	}
+	mutex_unlock(&zone->lock);
+
 	return 0;
 }
 
-static void my_block_release(struct gendisk *gd, fmode_t mode)
+/* write a user buffer at the write pointer and report where it went */
+static int my_zone_append(struct my_block_dev *dev,
+		struct my_zone_append __user *uarg)
 {
+	struct my_zone_append za;
+	struct my_zone *zone;
+	sector_t sector;
+	void *buf;
+	int err;
+
+	if (copy_from_user(&za, uarg, sizeof(za)))
+		return -EFAULT;
+	if (!za.len || za.len > MY_ZONE_APPEND_MAX ||
+			(za.len & (KERNEL_SECTOR_SIZE - 1)) ||
+			za.sector >= dev->nr_sectors)
+		return -EINVAL;
+
+	buf = kvmalloc(za.len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (copy_from_user(buf, u64_to_user_ptr(za.buf), za.len)) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	zone = my_zone_get(dev, za.sector);
+	if (zone->info.type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	mutex_lock(&zone->lock);
+	sector = zone->info.wp;
+	err = my_zone_check(zone, sector, za.len >> SECTOR_SHIFT);
+	if (!err)
+		err = my_restore_range(dev, sector, za.len >> SECTOR_SHIFT);
+	if (!err && !compress)
+		err = my_block_setup(dev, sector, za.len);
+	if (!err)
+		err = my_block_transfer(dev, sector, za.len, buf, 1);
+	my_zone_write_end(zone, za.len >> SECTOR_SHIFT, err);
+	if (err)
+		goto out;
+
+	za.sector = sector;
+	if (copy_to_user(uarg, &za, sizeof(za)))
+		err = -EFAULT;
+out:
+	kvfree(buf);
+	return err;
 }
 
-static const struct block_device_operations my_block_ops = {
-	.owner = THIS_MODULE,
-	.open = my_block_open,
-	.release = my_block_release
-};
+/*
+ * REQ_OP_ZONE_REPORT: the bio pages get a blk_zone_report_hdr followed
+ * by the zones starting at the one holding the bio sector.
+ */
+static int my_zone_report(struct my_block_dev *dev, struct bio *bio)
+{
+	struct blk_zone_report_hdr hdr;
+	struct blk_zone info;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	unsigned int zno, nr, rec = 0, off;
+	struct my_zone *zone;
+	u8 *mem;
 
-static void my_block_transfer(struct my_block_dev *dev, sector_t sector,
-		unsigned long len, char *buffer, int dir)
+	/* the header takes the place of the first zone */
+	BUILD_BUG_ON(sizeof(hdr) != sizeof(info));
+
+	if (bio->bi_iter.bi_sector >= dev->nr_sectors ||
+			bio->bi_iter.bi_size < 2 * sizeof(info))
+		return -EIO;
+
+	zno = bio->bi_iter.bi_sector >> dev->zone_shift;
+	nr = min_t(unsigned int, bio->bi_iter.bi_size / sizeof(info) - 1,
+			dev->nr_zones - zno);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.nr_zones = nr;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		mem = kmap(bvec.bv_page) + bvec.bv_offset;
+		for (off = 0; off + sizeof(info) <= bvec.bv_len && rec <= nr;
+				off += sizeof(info), rec++) {
+			if (!rec) {
+				memcpy(mem + off, &hdr, sizeof(hdr));
+				continue;
+			}
+			zone = &dev->zones[zno + rec - 1];
+			mutex_lock(&zone->lock);
+			info = zone->info;
+			mutex_unlock(&zone->lock);
+			memcpy(mem + off, &info, sizeof(info));
+		}
+		kunmap(bvec.bv_page);
+	}
+
+	return 0;
+}
+
+static int my_block_ioctl(struct block_device *bdev, fmode_t mode,
+		unsigned int cmd, unsigned long arg)
 {
-	unsigned long offset = sector * KERNEL_SECTOR_SIZE;
+	struct my_block_dev *dev = bdev->bd_disk->private_data;
+	u64 sector;
 
-	/* check for read/write beyond end of block device */
-	if ((offset + len) > dev->size)
-		return;
+	switch (cmd) {
+	case MY_IOCTL_SNAPSHOT:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return my_snapshot_save(dev);
+	case MY_IOCTL_ZONE_OPEN:
+	case MY_IOCTL_ZONE_CLOSE:
+	case MY_IOCTL_ZONE_FINISH:
+		if (!dev->zones)
+			return -ENOTTY;
+		if (!(mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&sector, (void __user *)arg, sizeof(sector)))
+			return -EFAULT;
+		return my_zone_manage(dev, sector, cmd);
+	case MY_IOCTL_ZONE_APPEND:
+		if (!dev->zones)
+			return -ENOTTY;
+		if (!(mode & FMODE_WRITE))
+			return -EBADF;
+		return my_zone_append(dev, (void __user *)arg);
+	}
 
-	/* Read/write to dev buffer depending on dir */
-	if (dir == 0) { //read 
-		memcpy(buffer, dev->data + offset, len);
-	} else if (dir == 1) { // write
-		memcpy(dev->data + offset, buffer, len);	
-	} else {
-		printk(KERN_ERR "invalid transfer direction %d\n", dir);
-		return;
+	return -ENOTTY;
+}
+
+static int my_xfer_bvec(struct my_block_dev *dev, struct bio_vec *bvec,
+		sector_t sector, int dir)
+{
+	char *buf;
+	int err;
+
+	err = my_restore_range(dev, sector, bvec->bv_len >> SECTOR_SHIFT);
+	if (err)
+		return err;
+
+	/* the compressed store may sleep for memory, so no kmap_atomic */
+	if (compress) {
+		buf = kmap(bvec->bv_page);
+		err = my_block_transfer(dev, sector, bvec->bv_len,
+				buf + bvec->bv_offset, dir);
+		kunmap(bvec->bv_page);
+		return err;
 	}
 
+	do {
+		if (dir == 1) {
+			err = my_block_setup(dev, sector, bvec->bv_len);
+			if (err)
+				return err;
+		}
+
+		buf = kmap_atomic(bvec->bv_page);
+		err = my_block_transfer(dev, sector, bvec->bv_len,
+				buf + bvec->bv_offset, dir);
+		kunmap_atomic(buf);
+		/* a discard raced the write, allocate its pages again */
+	} while (err == -EAGAIN);
+
+	return err;
 }
 
-/* to transfer data using bio structures enable USE_BIO_TRANFER */
-#if USE_BIO_TRANSFER == 1
-static void my_xfer_request(struct my_block_dev *dev, struct request *req)
+static int my_xfer_request(struct my_block_dev *dev, struct request *req)
 {
 	struct req_iterator iter; 
 	struct bio_vec bvec; 
-	sector_t sector;
-	char *buf;
-	unsigned long offset; 
-	size_t len; 
+	int err;
 
 	/* Iterate segments */
 	rq_for_each_segment(bvec, req, iter){
 		/* Copy bio data to device buffer */
-		sector = iter.iter.bi_sector; 
-		offset = bvec.bv_offset;
-		len = bvec.bv_len;
+		err = my_xfer_bvec(dev, &bvec, iter.iter.bi_sector,
+				bio_data_dir(iter.bio));
+		if (err)
+			return err;
+	}
 
-		buf = kmap_atomic(bvec.bv_page);
-		my_block_transfer(dev, sector, len, buf + offset, bio_data_dir(iter.bio));
-		kunmap_atomic(buf);
+	return 0;
+}
+
+static void my_account_io(struct my_block_dev *dev, int dir,
+		unsigned int bytes, unsigned int merges, int err, u64 start_ns)
+{
+	struct my_block_stats *st;
+	unsigned int bucket;
+
+	bucket = min_t(unsigned int, fls64(ktime_get_ns() - start_ns),
+			MY_LAT_BUCKETS - 1);
+
+	st = get_cpu_ptr(dev->stats);
+	st->ops[dir]++;
+	st->bytes[dir] += bytes;
+	st->merges[dir] += merges;
+	if (err)
+		st->errors[dir]++;
+	st->lat_hist[dir][bucket]++;
+	put_cpu_ptr(dev->stats);
+}
+
+static unsigned int my_rq_merges(struct request *rq)
+{
+	unsigned int nr_bios = 0;
+	struct bio *bio;
+
+	__rq_for_each_bio(bio, rq)
+		nr_bios++;
+
+	return nr_bios ? nr_bios - 1 : 0;
+}
+
+/*
+ * Completion time of a request: its transfer queues behind the channel
+ * that frees up first, so throughput saturates once more than
+ * lat.channels requests are in flight. The fixed latency overlaps.
+ */
+static u64 my_service_end(struct my_block_dev *dev, unsigned int bytes,
+		u64 now)
+{
+	u64 xfer = div_u64((u64)bytes * lat.ns_per_kb, 1024);
+	unsigned int i, best = 0;
+	u64 end;
+
+	spin_lock(&dev->lat_lock);
+	for (i = 1; i < lat.channels; i++)
+		if (dev->lat_busy[i] < dev->lat_busy[best])
+			best = i;
+	dev->lat_busy[best] = max(dev->lat_busy[best], now) + xfer;
+	end = dev->lat_busy[best] + lat.base_ns;
+	spin_unlock(&dev->lat_lock);
+
+	if (lat.spike_ppm && prandom_u32_max(1000000) < lat.spike_ppm)
+		end += lat.spike_ns;
+
+	return end;
+}
+
+static void my_complete_rq(struct request *rq)
+{
+	struct my_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct my_block_dev *dev = rq->q->queuedata;
+
+	my_account_io(dev, op_is_write(req_op(rq)), blk_rq_bytes(rq),
+			my_rq_merges(rq), cmd->err, cmd->start);
+	blk_mq_end_request(rq, errno_to_blk_status(cmd->err));
+}
+
+static enum hrtimer_restart my_cmd_timer(struct hrtimer *timer)
+{
+	struct my_cmd *cmd = container_of(timer, struct my_cmd, timer);
+
+	blk_mq_complete_request(blk_mq_rq_from_pdu(cmd));
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Called by blk-mq on the hardware context of the submitting CPU; there is
+ * no driver lock, so requests from different CPUs are served in parallel.
+ */
+static blk_status_t my_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct request *rq = bd->rq;
+	struct my_block_dev *dev = hctx->queue->queuedata;
+	struct my_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct my_zone *zone = NULL;
+	u64 start = ktime_get_ns();
+	int err;
+
+	blk_mq_start_request(rq);
+
+	/* Check fs request */
+	if (blk_rq_is_passthrough(rq)) {
+		printk (KERN_NOTICE "Skip non-fs request\n");
+		blk_mq_end_request(rq, BLK_STS_IOERR);
+		return BLK_STS_OK;
 	}
+
+	switch (req_op(rq)) {
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		err = my_block_discard(dev, blk_rq_pos(rq), blk_rq_sectors(rq));
+		break;
+	case REQ_OP_ZONE_REPORT:
+		err = my_zone_report(dev, rq->bio);
+		break;
+	case REQ_OP_ZONE_RESET:
+		err = my_zone_reset(dev, blk_rq_pos(rq));
+		break;
+	default:
+		if (dev->zones && req_op(rq) == REQ_OP_WRITE) {
+			err = my_zone_write_begin(dev, blk_rq_pos(rq),
+					blk_rq_sectors(rq), &zone);
+			if (err)
+				break;
+		}
+		/* Process the request by calling my_xfer_request */
+		err = my_xfer_request(dev, rq);
+		if (zone)
+			my_zone_write_end(zone, blk_rq_sectors(rq), err);
+		break;
+	}
+
+	cmd->start = start;
+	cmd->err = err;
+
+	/* the data is already copied, only the completion is held back */
+	if (lat_enabled) {
+		cmd->deadline = my_service_end(dev, blk_rq_bytes(rq), start);
+		hrtimer_start(&cmd->timer, ns_to_ktime(cmd->deadline +
+				(rq->cmd_flags & REQ_HIPRI ? MY_POLL_SLACK_NS : 0)),
+				HRTIMER_MODE_ABS);
+		return BLK_STS_OK;
+	}
+
+	my_complete_rq(rq);
+	return BLK_STS_OK;
+}
+
+/*
+ * Called by blk_poll from the submitting task. Without latency emulation
+ * requests already completed in queue_rq; otherwise complete the polled
+ * request in the caller's context as soon as its deadline passes.
+ */
+static int my_poll(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	struct request *rq = blk_mq_tag_to_rq(hctx->tags, tag);
+	struct my_cmd *cmd;
+
+	if (!lat_enabled || !rq)
+		return 0;
+
+	cmd = blk_mq_rq_to_pdu(rq);
+	if (ktime_get_ns() < cmd->deadline)
+		return 0;
+
+	/* whoever stops the timer completes the request */
+	if (hrtimer_try_to_cancel(&cmd->timer) != 1)
+		return 0;
+
+	blk_mq_complete_request(rq);
+	return 1;
+}
+
+static int my_init_request(struct blk_mq_tag_set *set, struct request *rq,
+		unsigned int hctx_idx, unsigned int numa_node)
+{
+	struct my_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	cmd->timer.function = my_cmd_timer;
+	return 0;
 }
-#endif
 
-static void my_block_request(struct request_queue *q)
+static const struct blk_mq_ops my_queue_ops = {
+	.queue_rq = my_queue_rq,
+	.complete = my_complete_rq,
+	.init_request = my_init_request,
+	.poll = my_poll,
+};
+
+/*
+ * Bio-based entry point: the backing store has no seek cost, so skip
+ * request allocation, merging and scheduling and complete bios inline.
+ */
+static blk_qc_t my_make_request(struct request_queue *q, struct bio *bio)
 {
-	struct request *rq;
 	struct my_block_dev *dev = q->queuedata;
+	struct my_zone *zone = NULL;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	u64 start = ktime_get_ns();
+	int err = 0;
 
-	while (1) {
+	/* bios must not cross zone boundaries */
+	if (dev->zones)
+		blk_queue_split(q, &bio);
+
+	switch (bio_op(bio)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+	case REQ_OP_FLUSH:
+		if (dev->zones && bio_op(bio) == REQ_OP_WRITE) {
+			err = my_zone_write_begin(dev, bio->bi_iter.bi_sector,
+					bio_sectors(bio), &zone);
+			if (err)
+				break;
+		}
+		bio_for_each_segment(bvec, bio, iter) {
+			err = my_xfer_bvec(dev, &bvec, iter.bi_sector,
+					bio_data_dir(bio));
+			if (err)
+				break;
+		}
+		if (zone)
+			my_zone_write_end(zone, bio_sectors(bio), err);
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		err = my_block_discard(dev, bio->bi_iter.bi_sector,
+				bio_sectors(bio));
+		break;
+	case REQ_OP_ZONE_REPORT:
+		err = dev->zones ? my_zone_report(dev, bio) : -EOPNOTSUPP;
+		break;
+	case REQ_OP_ZONE_RESET:
+		err = dev->zones ? my_zone_reset(dev, bio->bi_iter.bi_sector) :
+			-EOPNOTSUPP;
+		break;
+	default:
+		err = -EOPNOTSUPP;
+		break;
+	}
 
-		/* Fetch request */
-		rq = blk_fetch_request(q);
-		if (!rq) break; 
+	my_account_io(dev, op_is_write(bio_op(bio)), bio->bi_iter.bi_size, 0,
+			err, start);
+	bio->bi_status = errno_to_blk_status(err);
+	bio_endio(bio);
+	return BLK_QC_T_NONE;
+}
+
+/* Sum the per-CPU counters; only done when the stats file is read */
+static int my_stats_show(struct seq_file *m, void *v)
+{
+	struct my_block_dev *dev = m->private;
+	struct my_block_stats *sum, *st;
+	static const char * const dir_name[] = { "read", "write" };
+	int cpu, dir, i;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+		for (dir = 0; dir < 2; dir++) {
+			sum->ops[dir] += st->ops[dir];
+			sum->bytes[dir] += st->bytes[dir];
+			sum->merges[dir] += st->merges[dir];
+			sum->errors[dir] += st->errors[dir];
+			for (i = 0; i < MY_LAT_BUCKETS; i++)
+				sum->lat_hist[dir][i] += st->lat_hist[dir][i];
+		}
+	}
+
+	for (dir = 0; dir < 2; dir++)
+		seq_printf(m, "%s ops %llu bytes %llu merges %llu errors %llu\n",
+				dir_name[dir], sum->ops[dir], sum->bytes[dir],
+				sum->merges[dir], sum->errors[dir]);
 
-		/* Check fs request */
-		if (blk_rq_is_passthrough(rq)) {
-			printk (KERN_NOTICE "Skip non-fs request\n");
-			__blk_end_request_all(rq, -EIO);
+	/* one line per bucket: upper bound in ns, read count, write count */
+	seq_puts(m, "latency_ns read write\n");
+	for (i = 0; i < MY_LAT_BUCKETS; i++) {
+		if (!sum->lat_hist[0][i] && !sum->lat_hist[1][i])
 			continue;
+		seq_printf(m, "%llu %llu %llu\n", 1ULL << i,
+				sum->lat_hist[0][i], sum->lat_hist[1][i]);
+	}
+
+	kfree(sum);
+
+	if (compress) {
+		u64 nr_zpages = atomic64_read(&dev->nr_zpages);
+		u64 pool_bytes = (u64)zs_get_total_pages(dev->zpool)
+				<< PAGE_SHIFT;
+
+		/* ratio of stored data to pool memory, in percent */
+		seq_printf(m, "compression pages %llu same_filled %llu "
+				"compr_bytes %llu pool_bytes %llu ratio_pct %llu\n",
+				nr_zpages, atomic64_read(&dev->nr_same_pages),
+				atomic64_read(&dev->compr_bytes), pool_bytes,
+				pool_bytes ? div64_u64(nr_zpages * PAGE_SIZE * 100,
+					pool_bytes) : 0);
+	}
+
+	if (huge_pages)
+		seq_printf(m, "huge_pages %ld\n",
+				atomic_long_read(&dev->nr_hpages));
+
+	/* where the backing pages ended up */
+	for_each_online_node(i)
+		seq_printf(m, "node%d pages %ld\n", i,
+				atomic_long_read(&dev->node_pages[i]));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(my_stats);
+
+static int create_queue(struct my_block_dev *dev)
+{
+	int err;
+
+	if (queue_mode == MY_QUEUE_MODE_BIO) {
+		dev->queue = blk_alloc_queue(GFP_KERNEL);
+		if (dev->queue == NULL) {
+			printk(KERN_ERR "blk_alloc_queue: out of memory\n");
+			return -ENOMEM;
 		}
+		blk_queue_make_request(dev->queue, my_make_request);
+		return 0;
+	}
+
+	/* initialize the tag set, one hardware queue per CPU */
+	dev->tag_set.ops = &my_queue_ops;
+	dev->tag_set.nr_hw_queues = nr_cpu_ids;
+	dev->tag_set.queue_depth = hw_queue_depth;
+	dev->tag_set.numa_node = numa_policy == MY_NUMA_BIND ?
+			numa_node : NUMA_NO_NODE;
+	dev->tag_set.cmd_size = sizeof(struct my_cmd);
+	/* queue_rq may sleep allocating backing pages */
+	dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	dev->tag_set.driver_data = dev;
+	err = blk_mq_alloc_tag_set(&dev->tag_set);
+	if (err) {
+		printk(KERN_ERR "blk_mq_alloc_tag_set: failure\n");
+		return err;
+	}
+
+	dev->queue = blk_mq_init_queue(&dev->tag_set);
+	if (IS_ERR(dev->queue)) {
+		printk(KERN_ERR "blk_mq_init_queue: out of memory\n");
+		blk_mq_free_tag_set(&dev->tag_set);
+		err = PTR_ERR(dev->queue);
+		dev->queue = NULL;
+		return err;
+	}
 
-		/* Print request information */
-		pr_info("request received\n");
-		pr_info(" -> start_sector=%d\n", (int) blk_rq_pos(rq));
-		pr_info(" -> total_size=%d\n", blk_rq_bytes(rq)); 
-		pr_info(" -> data_size=%d\n", blk_rq_cur_bytes(rq));
-		pr_info(" -> direction=%d (0 for read, 1 for write)\n", rq_data_dir(rq));
+	return 0;
+}
 
-#if USE_BIO_TRANSFER == 1
-		/* Process the request by calling my_xfer_request */
-		my_xfer_request(dev, rq);
-#else
-		/* Process the request by calling my_block_transfer */
-		my_block_transfer(dev, blk_rq_pos(rq), blk_rq_cur_bytes(rq), bio_data(rq->bio), rq_data_dir(rq));
-#endif
+/* the first zone_nr_conv zones are conventional, the rest sequential */
+static int create_zones(struct my_block_dev *dev)
+{
+	sector_t zone_sectors, start = 0;
+	unsigned int i;
+
+	dev->zone_shift = ilog2(zone_size_mb) + 20 - SECTOR_SHIFT;
+	zone_sectors = (sector_t)1 << dev->zone_shift;
+	dev->nr_zones = DIV_ROUND_UP_SECTOR_T(dev->nr_sectors, zone_sectors);
+	dev->zones = kvcalloc(dev->nr_zones, sizeof(*dev->zones), GFP_KERNEL);
+	if (!dev->zones) {
+		printk(KERN_ERR "kvcalloc: out of memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		struct blk_zone *z = &dev->zones[i].info;
 
-		/* End request successfully */
-		__blk_end_request_all(rq, 0);
+		mutex_init(&dev->zones[i].lock);
+		z->start = z->wp = start;
+		/* the last zone is shorter if the capacity is not aligned */
+		z->len = min_t(sector_t, zone_sectors, dev->nr_sectors - start);
+		if (i < zone_nr_conv) {
+			z->type = BLK_ZONE_TYPE_CONVENTIONAL;
+			z->cond = BLK_ZONE_COND_NOT_WP;
+		} else {
+			z->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			z->cond = BLK_ZONE_COND_EMPTY;
+		}
+		start += zone_sectors;
 	}
+
+	return 0;
+}
+
+static void delete_queue(struct my_block_dev *dev)
+{
+	blk_cleanup_queue(dev->queue);
+	if (queue_mode == MY_QUEUE_MODE_MQ)
+		blk_mq_free_tag_set(&dev->tag_set);
 }
 
-static int create_block_device(struct my_block_dev *dev)
+static int create_block_device(struct my_block_dev *dev, int index)
 {
 	int err;
+	int i;
+
+	/* backing pages are allocated on first write */
+	dev->nr_sectors = nr_sectors;
+	spin_lock_init(&dev->lock);
+	INIT_RADIX_TREE(&dev->pages, GFP_ATOMIC);
+	INIT_RADIX_TREE(&dev->hpages, GFP_ATOMIC);
+	INIT_RADIX_TREE(&dev->zpages, GFP_ATOMIC);
+	for (i = 0; i < MY_ZLOCKS; i++)
+		spin_lock_init(&dev->zlocks[i]);
+	mutex_init(&dev->snap_lock);
 
-	dev->size = NR_SECTORS * KERNEL_SECTOR_SIZE;
-	dev->data = vmalloc(dev->size);
-	if (dev->data == NULL) {
-		printk(KERN_ERR "vmalloc: out of memory\n");
+	dev->stats = alloc_percpu(struct my_block_stats);
+	if (!dev->stats) {
+		printk(KERN_ERR "alloc_percpu: out of memory\n");
 		err = -ENOMEM;
-		goto out_vmalloc;
+		goto out_stats;
+	}
+
+	if (zoned) {
+		err = create_zones(dev);
+		if (err)
+			goto out_zones;
+	}
+
+	spin_lock_init(&dev->lat_lock);
+	if (lat_enabled) {
+		dev->lat_busy = kcalloc(lat.channels, sizeof(*dev->lat_busy),
+				GFP_KERNEL);
+		if (!dev->lat_busy) {
+			err = -ENOMEM;
+			goto out_lat;
+		}
 	}
 
 	/* initialize the I/O queue */
-	spin_lock_init(&dev->lock);
-	dev->queue = blk_init_queue(my_block_request, &dev->lock);
-	if (dev->queue == NULL) {
-		printk(KERN_ERR "blk_init_queue: out of memory\n");
-		err = -ENOMEM;
+	err = create_queue(dev);
+	if (err)
 		goto out_blk_init;
-	}
 	blk_queue_logical_block_size(dev->queue, KERNEL_SECTOR_SIZE);
 	dev->queue->queuedata = dev;
 
+	/* RWF_HIPRI direct I/O polls through my_poll */
+	if (queue_mode == MY_QUEUE_MODE_MQ)
+		blk_queue_flag_set(QUEUE_FLAG_POLL, dev->queue);
+
+	if (zoned) {
+		/* requests are split at zone boundaries; zone reset frees pages */
+		dev->queue->limits.zoned = BLK_ZONED_HM;
+		blk_queue_chunk_sectors(dev->queue, 1U << dev->zone_shift);
+	} else {
+		/* discarded pages are freed, so advertise page-sized granularity */
+		blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+		dev->queue->limits.discard_granularity = PAGE_SIZE;
+		blk_queue_max_discard_sectors(dev->queue, UINT_MAX);
+		blk_queue_max_write_zeroes_sectors(dev->queue, UINT_MAX);
+	}
+
 	/* initialize the gendisk structure */
 	dev->gd = alloc_disk(MY_BLOCK_MINORS);
 	if (!dev->gd) {
@@ -170,28 +2306,94 @@ static int create_block_device(struct my_block_dev *dev)
 	}
 
 	dev->gd->major = MY_BLOCK_MAJOR;
-	dev->gd->first_minor = 0;
+	dev->gd->first_minor = index * MY_BLOCK_MINORS;
 	dev->gd->fops = &my_block_ops;
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
-	snprintf(dev->gd->disk_name, DISK_NAME_LEN, "myblock");
-	set_capacity(dev->gd, NR_SECTORS);
+	snprintf(dev->gd->disk_name, DISK_NAME_LEN, "myblock%d", index);
+	set_capacity(dev->gd, dev->nr_sectors);
+
+	if (compress) {
+		dev->zpool = zs_create_pool(dev->gd->disk_name);
+		if (!dev->zpool) {
+			printk(KERN_ERR "zs_create_pool: failure\n");
+			err = -ENOMEM;
+			goto out_zpool;
+		}
+	}
+
+	/* pages are marked pending before the disk can see any I/O */
+	if (restore) {
+		err = my_restore_load(dev);
+		if (err)
+			goto out_restore;
+	}
 
 	add_disk(dev->gd);
 
+	/* without the thread, pages are still restored on first access */
+	if (atomic_long_read(&dev->nr_restore_pending)) {
+		dev->restore_thread = kthread_run(my_restore_thread, dev,
+				"%s-restore", dev->gd->disk_name);
+		if (IS_ERR(dev->restore_thread)) {
+			printk(KERN_WARNING "%s: no background restore\n",
+					dev->gd->disk_name);
+			dev->restore_thread = NULL;
+		}
+	}
+
+	/* statistics are exported in <debugfs>/ram-disk/myblockN/stats */
+	dev->debugfs_dir = debugfs_create_dir(dev->gd->disk_name,
+			my_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs_dir, dev,
+			&my_stats_fops);
+
 	return 0;
 
+out_restore:
+	if (dev->zpool)
+		zs_destroy_pool(dev->zpool);
+out_zpool:
+	put_disk(dev->gd);
 out_alloc_disk:
-	blk_cleanup_queue(dev->queue);
+	delete_queue(dev);
 out_blk_init:
-	vfree(dev->data);
-out_vmalloc:
+	kfree(dev->lat_busy);
+out_lat:
+	kvfree(dev->zones);
+out_zones:
+	free_percpu(dev->stats);
+out_stats:
 	return err;
 }
 
+static void delete_block_device(struct my_block_dev *dev)
+{
+	if (dev->restore_thread)
+		kthread_stop(dev->restore_thread);
+	debugfs_remove_recursive(dev->debugfs_dir);
+	if (dev->gd) {
+		del_gendisk(dev->gd);
+		put_disk(dev->gd);
+	}
+	if (dev->queue)
+		delete_queue(dev);
+	my_restore_cleanup(dev);
+	my_free_pages(dev);
+	if (dev->zpool)
+		my_zfree_pages(dev);
+	kfree(dev->lat_busy);
+	kvfree(dev->zones);
+	free_percpu(dev->stats);
+
+	/* wait for pages freed by discard */
+	rcu_barrier();
+}
+
 static int __init my_block_init(void)
 {
 	int err = 0;
+	int i;
 
 	/* Register block device */
 	err = register_blkdev(MY_BLOCK_MAJOR, MY_BLKDEV_NAME);
@@ -200,33 +2402,137 @@ static int __init my_block_init(void)
 		return err;
 	}
 
-	/* Create block device using create_block_device */
-	create_block_device(&g_dev);
+	if (queue_mode != MY_QUEUE_MODE_BIO && queue_mode != MY_QUEUE_MODE_MQ) {
+		printk(KERN_ERR "invalid queue_mode %d\n", queue_mode);
+		err = -EINVAL;
+		goto out;
+	}
+	if (nr_devices < 1 || nr_devices > MY_MAX_DEVICES) {
+		printk(KERN_ERR "invalid nr_devices %d\n", nr_devices);
+		err = -EINVAL;
+		goto out;
+	}
+	if (nr_sectors == 0) {
+		printk(KERN_ERR "invalid nr_sectors %lu\n", nr_sectors);
+		err = -EINVAL;
+		goto out;
+	}
+	if (hw_queue_depth < 1 || hw_queue_depth > BLK_MQ_MAX_DEPTH) {
+		printk(KERN_ERR "invalid hw_queue_depth %d\n", hw_queue_depth);
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (numa_policy < MY_NUMA_DEFAULT || numa_policy > MY_NUMA_LOCAL ||
+			(numa_policy == MY_NUMA_BIND &&
+			 (numa_node < 0 || numa_node >= MAX_NUMNODES ||
+			  !node_online(numa_node))) ||
+			(numa_policy == MY_NUMA_INTERLEAVE &&
+			 numa_stripe_kb < (PAGE_SIZE >> 10))) {
+		printk(KERN_ERR "invalid NUMA placement parameters\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (compress && huge_pages) {
+		printk(KERN_ERR "compress and huge_pages are mutually exclusive\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	/* restored pages would bypass the write pointers */
+	if (zoned && restore) {
+		printk(KERN_ERR "zoned is incompatible with restore\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (zoned && (!is_power_of_2(zone_size_mb) ||
+			DIV_ROUND_UP_ULL(nr_sectors, (u64)zone_size_mb <<
+				(20 - SECTOR_SHIFT)) <= zone_nr_conv)) {
+		printk(KERN_ERR "invalid zone_size_mb %u or zone_nr_conv %u\n",
+				zone_size_mb, zone_nr_conv);
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (lat_profile < MY_LAT_NONE || lat_profile > MY_LAT_NVME) {
+		printk(KERN_ERR "invalid lat_profile %d\n", lat_profile);
+		err = -EINVAL;
+		goto out;
+	}
+
+	lat = my_lat_profiles[lat_profile];
+	if (lat_base_ns)
+		lat.base_ns = lat_base_ns;
+	if (lat_ns_per_kb)
+		lat.ns_per_kb = lat_ns_per_kb;
+	if (lat_channels)
+		lat.channels = lat_channels;
+	if (lat_spike_ppm)
+		lat.spike_ppm = lat_spike_ppm;
+	if (lat_spike_ns)
+		lat.spike_ns = lat_spike_ns;
+	if (!lat.channels)
+		lat.channels = 1;
+	lat_enabled = lat.base_ns || lat.ns_per_kb ||
+		(lat.spike_ppm && lat.spike_ns);
+
+	/* delayed completions live in the blk-mq request data */
+	if (lat_enabled && queue_mode != MY_QUEUE_MODE_MQ) {
+		printk(KERN_ERR "latency emulation needs queue_mode=1\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (compress) {
+		err = create_zstreams();
+		if (err)
+			goto out;
+	}
+
+	devices = kcalloc(nr_devices, sizeof(*devices), GFP_KERNEL);
+	if (!devices) {
+		err = -ENOMEM;
+		goto out_devices;
+	}
+
+	my_debugfs_root = debugfs_create_dir(MODULE_NAME, NULL);
+
+	/* Create block devices using create_block_device */
+	for (i = 0; i < nr_devices; i++) {
+		err = create_block_device(&devices[i], i);
+		if (err < 0)
+			goto out_create;
+	}
 
 	return 0;
 
+out_create:
+	while (--i >= 0)
+		delete_block_device(&devices[i]);
+	debugfs_remove_recursive(my_debugfs_root);
+	kfree(devices);
+out_devices:
+	if (compress)
+		destroy_zstreams();
 out:
 	/* Unregister block device in case of an error */
 	unregister_blkdev(MY_BLOCK_MAJOR, MY_BLKDEV_NAME);
 	return err;
 }
 
-static void delete_block_device(struct my_block_dev *dev)
-{
-	if (dev->gd) {
-		del_gendisk(dev->gd);
-		put_disk(dev->gd);
-	}
-	if (dev->queue)
-		blk_cleanup_queue(dev->queue);
-	if (dev->data)
-		vfree(dev->data);
-}
-
 static void __exit my_block_exit(void)
 {
-	/* Cleanup block device using delete_block_device */
-	delete_block_device(&g_dev);
+	int i;
+
+	/* Cleanup block devices using delete_block_device */
+	for (i = 0; i < nr_devices; i++)
+		delete_block_device(&devices[i]);
+	debugfs_remove_recursive(my_debugfs_root);
+	kfree(devices);
+	if (compress)
+		destroy_zstreams();
 
 	/* Unregister block device */
 	unregister_blkdev(MY_BLOCK_MAJOR, MY_BLKDEV_NAME);
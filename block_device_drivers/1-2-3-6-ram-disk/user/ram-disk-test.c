@@ -1,16 +1,33 @@
 /*
  * SO2 - Block device driver (#8)
  * Test suite for exercise #3 (RAM Disk)
+ *
+ * Without arguments the module is loaded and every sector is written and
+ * read back. With -B the already loaded disk is benchmarked with O_DIRECT
+ * I/O from several threads, each keeping iodepth requests in flight
+ * through Linux native AIO. With -p each thread instead issues one
+ * RWF_HIPRI request at a time and the kernel polls for its completion.
  */
 
+#define _GNU_SOURCE			/* O_DIRECT */
+#define _FILE_OFFSET_BITS 64	/* disks past 2 GiB under -m32 */
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <linux/aio_abi.h>
+#include <linux/fs.h>
 
 #define NR_SECTORS	128
 #define SECTOR_SIZE	512
@@ -49,7 +66,7 @@ static void test_sector(int fd, size_t sector)
 		printf("failed\n");
 }
 
-int main(void)
+static int run_verify(void)
 {
 	int fd;
 	size_t i;
@@ -83,3 +100,478 @@ int main(void)
 
 	return 0;
 }
+
+/*
+ * Benchmark mode
+ */
+
+/*
+ * Log-linear latency histogram: values are grouped by their highest set
+ * bit and split in LAT_SUB linear steps, which keeps the error of the
+ * reported percentiles around 3%.
+ */
+#define LAT_SUB_BITS	5
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_BUCKETS	(64 * LAT_SUB)
+
+#define MAX_IODEPTH	1024
+
+/* polled I/O flag of preadv2 and pwritev2, older headers lack it */
+#ifndef RWF_HIPRI
+#define RWF_HIPRI	0x00000001
+#endif
+
+struct bench_params {
+	const char *path;
+	int threads;
+	size_t bs;
+	int iodepth;
+	int read_pct;		/* percentage of reads in the mix */
+	int random;
+	int runtime;		/* seconds */
+	int hipri;		/* polled synchronous I/O */
+	uint64_t dev_size;
+};
+
+struct bench_thread {
+	pthread_t tid;
+	int index;
+	const struct bench_params *p;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t lat_sum;
+	uint64_t lat_hist[LAT_BUCKETS];
+};
+
+static inline int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+		struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int lat_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < LAT_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - LAT_SUB_BITS + 1) * LAT_SUB +
+		((ns >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/* lower bound of the values counted in bucket b */
+static uint64_t lat_bucket_value(unsigned int b)
+{
+	unsigned int msb;
+
+	if (b < LAT_SUB)
+		return b;
+
+	msb = b / LAT_SUB + LAT_SUB_BITS - 1;
+	return (1ULL << msb) |
+		((uint64_t)(b % LAT_SUB) << (msb - LAT_SUB_BITS));
+}
+
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t total,
+		double pct)
+{
+	uint64_t target = (uint64_t)(total * pct / 100.0);
+	uint64_t seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > target)
+			return lat_bucket_value(b);
+	}
+
+	return 0;
+}
+
+/* xorshift64*, one state per thread */
+static inline uint64_t next_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t next_block(const struct bench_params *p, uint64_t *rng,
+		uint64_t *seq_block, uint64_t nr_blocks)
+{
+	uint64_t block;
+
+	if (p->random)
+		return next_rand(rng) % nr_blocks;
+
+	block = (*seq_block)++;
+	if (*seq_block >= nr_blocks)
+		*seq_block = 0;
+	return block;
+}
+
+static int bench_open(const char *path)
+{
+	int fd = open(path, O_RDWR | O_DIRECT);
+
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/* one polled request at a time, the latency is the full round trip */
+static void bench_hipri(struct bench_thread *t, uint64_t rng,
+		uint64_t seq_block)
+{
+	const struct bench_params *p = t->p;
+	uint64_t nr_blocks = p->dev_size / p->bs;
+	uint64_t deadline, ns, lat;
+	struct iovec iov;
+	ssize_t ret;
+	void *buf;
+	int fd;
+
+	fd = bench_open(p->path);
+	if (posix_memalign(&buf, 4096, p->bs)) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 0xa5, p->bs);
+	iov.iov_base = buf;
+	iov.iov_len = p->bs;
+
+	deadline = now_ns() + (uint64_t)p->runtime * 1000000000ULL;
+	while ((ns = now_ns()) < deadline) {
+		off_t off = next_block(p, &rng, &seq_block, nr_blocks) * p->bs;
+
+		if ((int)(next_rand(&rng) % 100) < p->read_pct)
+			ret = preadv2(fd, &iov, 1, off, RWF_HIPRI);
+		else
+			ret = pwritev2(fd, &iov, 1, off, RWF_HIPRI);
+		if (ret < 0 && errno == EOPNOTSUPP) {
+			fprintf(stderr, "kernel does not support RWF_HIPRI\n");
+			exit(EXIT_FAILURE);
+		}
+
+		lat = now_ns() - ns;
+		if (ret != (ssize_t)p->bs)
+			t->errors++;
+		else
+			t->bytes += p->bs;
+		t->ops++;
+		t->lat_sum += lat;
+		t->lat_hist[lat_bucket(lat)]++;
+	}
+
+	free(buf);
+	close(fd);
+}
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *t = arg;
+	const struct bench_params *p = t->p;
+	struct iocb iocbs[MAX_IODEPTH], *iocbp[MAX_IODEPTH];
+	struct io_event events[MAX_IODEPTH];
+	uint64_t submit_ns[MAX_IODEPTH];
+	uint64_t nr_blocks = p->dev_size / p->bs;
+	uint64_t region, seq_block, rng, deadline, ns;
+	aio_context_t ctx = 0;
+	int inflight = 0, nr, i, fd;
+	void *buf;
+
+	/* sequential streams start in separate regions of the disk */
+	region = nr_blocks / p->threads;
+	seq_block = region * t->index;
+	rng = 0x9E3779B97F4A7C15ULL * (t->index + 1) ^ now_ns();
+
+	if (p->hipri) {
+		bench_hipri(t, rng, seq_block);
+		return NULL;
+	}
+
+	fd = bench_open(p->path);
+
+	if (io_setup(p->iodepth, &ctx) < 0) {
+		perror("io_setup");
+		exit(EXIT_FAILURE);
+	}
+
+	if (posix_memalign(&buf, 4096, p->bs * p->iodepth)) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 0xa5, p->bs * p->iodepth);
+
+	deadline = now_ns() + (uint64_t)p->runtime * 1000000000ULL;
+	nr = p->iodepth;
+	for (i = 0; i < p->iodepth; i++)
+		iocbp[i] = &iocbs[i];
+
+	while (1) {
+		int to_submit = 0;
+
+		ns = now_ns();
+		if (ns >= deadline)
+			nr = 0;
+
+		/* refill the free slots, iocbp[0..nr) */
+		for (i = 0; i < nr; i++) {
+			struct iocb *cb = iocbp[i];
+			int slot = cb - iocbs;
+			uint64_t block;
+
+			block = next_block(p, &rng, &seq_block, nr_blocks);
+			memset(cb, 0, sizeof(*cb));
+			cb->aio_fildes = fd;
+			cb->aio_lio_opcode =
+				(int)(next_rand(&rng) % 100) < p->read_pct ?
+				IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+			cb->aio_buf = (uintptr_t)buf + slot * p->bs;
+			cb->aio_nbytes = p->bs;
+			cb->aio_offset = block * p->bs;
+			cb->aio_data = slot;
+			submit_ns[slot] = ns;
+			to_submit++;
+		}
+
+		if (to_submit) {
+			int ret = io_submit(ctx, to_submit, iocbp);
+
+			if (ret != to_submit) {
+				perror("io_submit");
+				exit(EXIT_FAILURE);
+			}
+			inflight += to_submit;
+		}
+
+		if (!inflight)
+			break;
+
+		nr = io_getevents(ctx, 1, inflight, events, NULL);
+		if (nr < 0) {
+			if (errno == EINTR) {
+				nr = 0;
+				continue;
+			}
+			perror("io_getevents");
+			exit(EXIT_FAILURE);
+		}
+
+		ns = now_ns();
+		for (i = 0; i < nr; i++) {
+			int slot = events[i].data;
+			uint64_t lat = ns - submit_ns[slot];
+
+			if (events[i].res != (int64_t)p->bs)
+				t->errors++;
+			else
+				t->bytes += p->bs;
+			t->ops++;
+			t->lat_sum += lat;
+			t->lat_hist[lat_bucket(lat)]++;
+			iocbp[i] = &iocbs[slot];
+		}
+		inflight -= nr;
+	}
+
+	io_destroy(ctx);
+	free(buf);
+	close(fd);
+
+	return NULL;
+}
+
+static int run_bench(struct bench_params *p)
+{
+	struct bench_thread *threads;
+	uint64_t *hist, ops = 0, bytes = 0, errors = 0, lat_sum = 0;
+	uint64_t start, elapsed;
+	struct stat st;
+	double secs;
+	int fd, i, b;
+
+	/* a regular file can stand in for the disk when testing the tool */
+	fd = open(p->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(p->path);
+		return EXIT_FAILURE;
+	}
+	if (!S_ISBLK(st.st_mode))
+		p->dev_size = st.st_size;
+	else if (ioctl(fd, BLKGETSIZE64, &p->dev_size) < 0) {
+		perror("BLKGETSIZE64");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	if (p->dev_size / p->bs < (uint64_t)p->threads) {
+		fprintf(stderr, "device too small for %d threads of %zu bytes\n",
+				p->threads, p->bs);
+		return EXIT_FAILURE;
+	}
+
+	threads = calloc(p->threads, sizeof(*threads));
+	hist = calloc(LAT_BUCKETS, sizeof(*hist));
+	if (!threads || !hist) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	for (i = 0; i < p->threads; i++) {
+		threads[i].index = i;
+		threads[i].p = p;
+		if (pthread_create(&threads[i].tid, NULL, bench_thread_fn,
+					&threads[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < p->threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ops += threads[i].ops;
+		bytes += threads[i].bytes;
+		errors += threads[i].errors;
+		lat_sum += threads[i].lat_sum;
+		for (b = 0; b < LAT_BUCKETS; b++)
+			hist[b] += threads[i].lat_hist[b];
+	}
+	elapsed = now_ns() - start;
+	secs = elapsed / 1e9;
+
+	/* one JSON object per run */
+	printf("{\"device\":\"%s\",\"threads\":%d,\"bs\":%zu,\"iodepth\":%d,"
+			"\"read_pct\":%d,\"pattern\":\"%s\",\"polled\":%s,"
+			"\"runtime_s\":%.3f,"
+			"\"ops\":%llu,\"errors\":%llu,\"iops\":%.0f,"
+			"\"bw_MiBps\":%.2f,\"lat_ns\":{\"mean\":%llu,\"p50\":%llu,"
+			"\"p99\":%llu,\"p999\":%llu}}\n",
+			p->path, p->threads, p->bs,
+			p->hipri ? 1 : p->iodepth, p->read_pct,
+			p->random ? "rand" : "seq",
+			p->hipri ? "true" : "false", secs,
+			(unsigned long long)ops, (unsigned long long)errors,
+			ops / secs, bytes / secs / (1024 * 1024),
+			(unsigned long long)(ops ? lat_sum / ops : 0),
+			(unsigned long long)lat_percentile(hist, ops, 50.0),
+			(unsigned long long)lat_percentile(hist, ops, 99.0),
+			(unsigned long long)lat_percentile(hist, ops, 99.9));
+
+	free(hist);
+	free(threads);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s                run the data verification test\n"
+		"       %s -B [options]   benchmark a loaded disk\n"
+		"  -f path    device (default " DEVICE_NAME ")\n"
+		"  -t n       threads (default 1)\n"
+		"  -b bytes   block size, multiple of %d (default 4096)\n"
+		"  -q n       queue depth per thread, up to %d (default 32)\n"
+		"  -r pct     percentage of reads (default 100)\n"
+		"  -R         random offsets instead of sequential\n"
+		"  -s sec     runtime in seconds (default 10)\n"
+		"  -p         polled RWF_HIPRI I/O, queue depth 1\n",
+		prog, prog, SECTOR_SIZE, MAX_IODEPTH);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_params p = {
+		.path = DEVICE_NAME,
+		.threads = 1,
+		.bs = 4096,
+		.iodepth = 32,
+		.read_pct = 100,
+		.random = 0,
+		.runtime = 10,
+	};
+	int bench = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "Bf:t:b:q:r:Rs:p")) != -1) {
+		switch (opt) {
+		case 'B':
+			bench = 1;
+			break;
+		case 'f':
+			p.path = optarg;
+			break;
+		case 't':
+			p.threads = atoi(optarg);
+			break;
+		case 'b':
+			p.bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			p.iodepth = atoi(optarg);
+			break;
+		case 'r':
+			p.read_pct = atoi(optarg);
+			break;
+		case 'R':
+			p.random = 1;
+			break;
+		case 's':
+			p.runtime = atoi(optarg);
+			break;
+		case 'p':
+			p.hipri = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!bench) {
+		if (optind != argc || argc > 1)
+			usage(argv[0]);
+		return run_verify();
+	}
+
+	if (p.threads < 1 || p.bs == 0 || p.bs % SECTOR_SIZE ||
+			p.iodepth < 1 || p.iodepth > MAX_IODEPTH ||
+			p.read_pct < 0 || p.read_pct > 100 || p.runtime < 1)
+		usage(argv[0]);
+
+	return run_bench(&p);
+}
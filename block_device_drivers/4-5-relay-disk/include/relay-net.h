@@ -0,0 +1,64 @@
+/*
+ * SO2 Lab - Block device drivers (#7)
+ * Linux - Exercise #4, #5 (Relay disk - bio)
+ *
+ * Protocol between a network relay and relay-server, shared with user
+ * space. All fields are big endian.
+ */
+
+#ifndef __RELAY_NET_H__
+#define __RELAY_NET_H__
+
+#include <linux/types.h>
+
+#define RELAY_NET_PORT		60000
+
+#define RELAY_NET_HELLO_MAGIC	0x524c4e48U	/* "RLNH" */
+#define RELAY_NET_REQ_MAGIC	0x524c4e51U	/* "RLNQ" */
+#define RELAY_NET_REPLY_MAGIC	0x524c4e52U	/* "RLNR" */
+
+/* largest read or write payload of one request */
+#define RELAY_NET_MAX_LEN	(1U << 20)
+
+/* sent by the server on every new connection */
+struct relay_net_hello {
+	__be32 magic;
+	__be32 flags;		/* RELAY_NET_HAS_* */
+	__be64 nr_sectors;	/* size of the store, in 512 byte sectors */
+};
+
+#define RELAY_NET_HAS_DISCARD	(1U << 0)
+
+/* request operations */
+#define RELAY_NET_READ		0
+#define RELAY_NET_WRITE		1
+#define RELAY_NET_FLUSH		2
+#define RELAY_NET_DISCARD	3
+
+/* request flags */
+#define RELAY_NET_F_FLUSH	(1U << 0)	/* flush before the operation */
+#define RELAY_NET_F_FUA		(1U << 1)	/* write through to stable media */
+
+/*
+ * A request, followed by len bytes of data for writes. Requests are
+ * pipelined: a client sends more before the earlier ones are answered,
+ * and the tag it picks matches the reply to the request.
+ */
+struct relay_net_req {
+	__be32 magic;
+	__be16 op;
+	__be16 flags;
+	__be64 tag;
+	__be64 sector;
+	__be32 len;		/* bytes, multiple of 512 */
+	__be32 reserved;
+};
+
+/* a reply, followed by the data of a successful read */
+struct relay_net_reply {
+	__be32 magic;
+	__be32 error;		/* 0 or a positive errno */
+	__be64 tag;
+};
+
+#endif /* __RELAY_NET_H__ */
@@ -10,6 +10,31 @@
 #include <linux/sched.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/mempool.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/idr.h>
+#include <linux/device.h>
+#include <linux/string.h>
+#include <linux/radix-tree.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/bitmap.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/net.h>
+#include <linux/in.h>
+#include <linux/inet.h>
+#include <linux/tcp.h>
+#include <net/sock.h>
+
+#include "include/relay-net.h"
 
 MODULE_AUTHOR("SO2");
 MODULE_DESCRIPTION("Relay disk");
@@ -17,86 +42,3372 @@ MODULE_LICENSE("GPL");
 
 #define KERN_LOG_LEVEL		KERN_ALERT
 
-#define PHYSICAL_DISK_NAME	"/dev/vdb"
 #define KERNEL_SECTOR_SIZE	512
 
 #define BIO_WRITE_MESSAGE	"def"
 
+#define RELAY_BLKDEV_NAME	"relay"
+#define RELAY_MINORS		16
+#define RELAY_MAX_DEVICES	(MINORMASK / RELAY_MINORS + 1)
+#define RELAY_PATH_LEN		256
+#define RELAY_MAX_MEMBERS	8
 
-/* pointer to physical device structure */
-static struct block_device *phys_bdev;
+/* how relay sectors map onto the member disks */
+#define RELAY_LINEAR		0	/* one member, from offset on */
+#define RELAY_STRIPE		1	/* RAID0, chunk by chunk in turn */
+#define RELAY_MIRROR		2	/* RAID1, same sectors on every member */
+#define RELAY_NET		3	/* relay-server over TCP, no members */
 
-static void send_test_bio(struct block_device *bdev, int dir)
-{
-	struct bio *bio = bio_alloc(GFP_NOIO, 1);
+/* member flags */
+#define RELAY_MEMBER_FAILED	0	/* an I/O failed, no longer used */
+
+static char *phys_disk;
+module_param(phys_disk, charp, 0444);
+MODULE_PARM_DESC(phys_disk, "Block device of a relay created at load time; "
+		"more are added through /sys/class/relay/add");
+
+static bool test_bio;
+module_param(test_bio, bool, 0444);
+MODULE_PARM_DESC(test_bio, "Read sector 0 of the phys_disk relay at load "
+		"time and write it at unload");
+
+/* largest I/O the relay issues with its own pages */
+#define RELAY_IO_MAX_PAGES	32
+
+static int io_depth = 32;
+module_param(io_depth, int, 0444);
+MODULE_PARM_DESC(io_depth, "Maximum in-flight I/Os the relay issues on its own");
+
+static unsigned int cache_mb;
+module_param(cache_mb, uint, 0444);
+MODULE_PARM_DESC(cache_mb, "Read cache size of each relay in MiB, 0 disables it");
+
+static unsigned int readahead_kb;
+module_param(readahead_kb, uint, 0444);
+MODULE_PARM_DESC(readahead_kb, "Largest readahead window of a sequential "
+		"read stream in KiB, 0 disables readahead");
+
+static unsigned int coalesce_us;
+module_param(coalesce_us, uint, 0444);
+MODULE_PARM_DESC(coalesce_us, "Longest a small write waits to be merged with "
+		"adjacent ones, in microseconds; 0 disables coalescing");
+
+static unsigned int coalesce_kb = 128;
+module_param(coalesce_kb, uint, 0444);
+MODULE_PARM_DESC(coalesce_kb, "Largest merged write in KiB");
+
+static bool writeback;
+module_param(writeback, bool, 0444);
+MODULE_PARM_DESC(writeback, "Acknowledge writes once buffered in RAM and "
+		"write them back from a flusher thread");
+
+static unsigned int wb_mb = 64;
+module_param(wb_mb, uint, 0444);
+MODULE_PARM_DESC(wb_mb, "Write-back buffer size of each relay in MiB");
+
+static unsigned int dirty_background_ratio = 10;
+module_param(dirty_background_ratio, uint, 0444);
+MODULE_PARM_DESC(dirty_background_ratio, "Percentage of the buffer dirty "
+		"before the flusher starts early");
+
+static unsigned int dirty_ratio = 50;
+module_param(dirty_ratio, uint, 0444);
+MODULE_PARM_DESC(dirty_ratio, "Percentage of the buffer dirty at which "
+		"writers wait for write-back");
+
+static unsigned int wb_expire_ms = 1000;
+module_param(wb_expire_ms, uint, 0444);
+MODULE_PARM_DESC(wb_expire_ms, "Interval at which all dirty data is written back");
+
+/* write-back attempts at teardown before dirty data is given up */
+#define RELAY_WB_TRIES		3
+
+/* the read cache works on page-sized blocks of the relay */
+#define RELAY_CBLOCK_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define RELAY_CBLOCK_SECTORS	(1 << RELAY_CBLOCK_SHIFT)
+
+/* write generations, each covering RELAY_GEN_BLOCKS consecutive blocks */
+#define RELAY_CACHE_GENS	64
+#define RELAY_GEN_SHIFT		4
+
+/* cache lists of the 2Q policy */
+#define RELAY_A1IN		0	/* seen once, FIFO */
+#define RELAY_AM		1	/* seen again, LRU */
+#define RELAY_A1OUT		2	/* evicted from A1in, key only */
+
+/* sequential read streams tracked by each relay */
+#define RELAY_RA_STREAMS	8
+/* first readahead window, in blocks */
+#define RELAY_RA_MIN		4
+
+/* a read stream; sequential once a read starts where the last one ended */
+struct relay_stream {
+	sector_t next;
+	/* readahead requested and issued up to these blocks */
+	pgoff_t ra_end;
+	pgoff_t ra_issued;
+	/* blocks read ahead of the stream, 0 until it is sequential */
+	unsigned int window;
+	u64 stamp;
+};
+
+/*
+ * Writes coalesced into one run of sectors from start, copied to pages in
+ * arrival order so the latest data wins where they overlap
+ */
+struct relay_plug {
+	struct list_head list;
+	sector_t start;
+	sector_t end;
+	unsigned int nr_pages;
+	struct page *pages[RELAY_IO_MAX_PAGES];
+	/* the writes, completed with the merged one */
+	struct bio_list bios;
+};
+
+/* a buffered block with data not yet on the target */
+struct relay_dblock {
+	pgoff_t index;
 	struct page *page;
-	char *buf;
-	int i;
+	/* sectors of the block holding data */
+	DECLARE_BITMAP(valid, RELAY_CBLOCK_SECTORS);
+	/* latest write to the block and oldest one not on the target yet */
+	u64 seq;
+	u64 first_seq;
+	/*
+	 * Write-back I/Os in flight for the block, the error of its last
+	 * write-back and the flush that started it, 0 for the flusher
+	 */
+	unsigned int wb_pending;
+	int wb_error;
+	u64 wb_flush;
+};
 
-	/* Fill bio (bdev, sector, direction) */
-	bio->bi_disk = bdev->bd_disk;
-	bio->bi_iter.bi_sector = 0;
-	bio->bi_opf = dir ? REQ_OP_WRITE : REQ_OP_READ;
+/* a write-back I/O: one run of adjacent blocks, or part of one block */
+struct relay_wb_io {
+	unsigned int nr;
+	struct relay_dblock *blocks[RELAY_IO_MAX_PAGES];
+	u64 seqs[RELAY_IO_MAX_PAGES];
+};
 
-	page = alloc_page(GFP_NOIO);
-	bio_add_page(bio, page, KERNEL_SECTOR_SIZE, 0);
+/* a cached block; ghosts on A1out have no page */
+struct relay_cblock {
+	struct list_head list;
+	pgoff_t index;
+	struct page *page;
+	int queue;
+};
 
-	/* Write message to bio buffer if direction is write */
-	if (dir == REQ_OP_WRITE) {
-		buf = kmap_atomic(page);
-		memcpy(buf, BIO_WRITE_MESSAGE, 3);
-		kunmap_atomic(buf);
+/* a physical disk under the relay */
+struct relay_member {
+	char path[RELAY_PATH_LEN];
+	struct block_device *bdev;
+	/* mirror state, read balancing and statistics */
+	unsigned long flags;
+	atomic_t inflight;
+	sector_t head;
+	atomic64_t ios;
+	atomic64_t lat_ns;
+};
+
+/*
+ * A stacking disk: every bio is cloned to the physical devices, sharing
+ * its data pages, and completed when the clone completes.
+ */
+struct relay_dev {
+	struct list_head list;
+	int index;
+	/* target devices and the range of them the relay exposes */
+	int layout;
+	unsigned int nr_members;
+	struct relay_member members[RELAY_MAX_MEMBERS];
+	unsigned int chunk_sectors;
+	/* network layout: the server and connections to it */
+	struct sockaddr_in net_addr;
+	unsigned int net_flags;
+	unsigned int nr_conns;
+	struct relay_conn *conns;
+	atomic_t net_next;
+	/* every member is solid state, seeks cost nothing */
+	bool nonrot;
+	sector_t offset;
+	sector_t nr_sectors;
+	/* protected by relay_lock */
+	int open_count;
+	bool deleting;
+	struct request_queue *queue;
+	struct gendisk *gd;
+	/* clones share the original bio_vec, no bvecs needed */
+	struct bio_set bio_set;
+	/* stripe fragments and flushes, mirror copies of clones */
+	struct bio_set split_set;
+	/* mirror reads to send again to another member */
+	spinlock_t retry_lock;
+	struct bio_list retry;
+	struct work_struct retry_work;
+	/* stripe writes waiting for their member flushes to finish */
+	spinlock_t preflush_lock;
+	struct bio_list preflushed;
+	struct work_struct preflush_work;
+	/* asynchronous engine for I/O with the relay's own pages */
+	struct bio_set io_bio_set;
+	mempool_t *page_pool;
+	struct mutex io_alloc_lock;
+	atomic_t io_inflight;
+	wait_queue_head_t io_wait;
+	spinlock_t io_lock;
+	/* 2Q read cache, everything below is protected by cache_lock */
+	spinlock_t cache_lock;
+	struct radix_tree_root cache;
+	struct list_head cache_lists[3];
+	unsigned long cache_len[3];
+	/* budget and list targets, in blocks */
+	unsigned long cache_budget;
+	unsigned long cache_kin;
+	unsigned long cache_kout;
+	u64 cache_gen[RELAY_CACHE_GENS];
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 cache_evictions;
+	/* read streams and their readahead, protected by ra_lock */
+	spinlock_t ra_lock;
+	struct relay_stream streams[RELAY_RA_STREAMS];
+	u64 ra_clock;
+	u64 ra_blocks;
+	unsigned int ra_max;
+	struct work_struct ra_work;
+	/* write coalescing, everything below is protected by plug_lock */
+	spinlock_t plug_lock;
+	unsigned int plug_max;
+	struct relay_plug *plug;
+	struct hrtimer plug_timer;
+	/* closed plugs, and the flush and FUA bios queued behind them */
+	struct list_head plug_ready;
+	struct bio_list plug_after;
+	bool plug_busy;
+	struct work_struct plug_work;
+	u64 coalesced_bios;
+	u64 coalesced_writes;
+	/* write-back buffer, protected by wb_lock */
+	spinlock_t wb_lock;
+	struct radix_tree_root dirty;
+	unsigned long nr_dirty;
+	unsigned long wb_background;
+	unsigned long wb_limit;
+	u64 wb_seq;
+	/* write-back completions, waited on by flushes and writers */
+	u64 wb_done;
+	u64 wb_flushes;
+	wait_queue_head_t wb_wait;
+	/* bios that need write-back first, run by the flusher */
+	struct bio_list wb_deferred;
+	bool wb_kick;
+	wait_queue_head_t flusher_wait;
+	struct task_struct *flusher;
+};
+
+/* a forwarded clone, allocated as front padding of its bio */
+struct relay_clone {
+	struct relay_dev *dev;
+	struct bio *orig;
+	/* write generations seen when a read was sent */
+	u64 cache_gen;
+	struct bio clone;
+};
+
+/* connections of a network relay and requests in flight on each */
+#define RELAY_NET_CONNS		4
+#define RELAY_NET_MAX_CONNS	8
+#define RELAY_NET_DEPTH		64
+
+/* a request in flight, tagged with its slot in the low bits */
+struct relay_net_slot {
+	struct bio *bio;
+	u64 tag;
+	/* one held by the sender, one by the reply */
+	atomic_t refs;
+	bool replied;
+	blk_status_t status;
+};
+
+/* a connection to relay-server, each with its own receiver thread */
+struct relay_conn {
+	struct relay_dev *dev;
+	unsigned int index;
+	struct socket *sock;
+	/* requests go out whole, one sender at a time */
+	struct mutex send_lock;
+	/* slots, protected by lock; senders wait for a free one */
+	spinlock_t lock;
+	bool dead;
+	DECLARE_BITMAP(busy, RELAY_NET_DEPTH);
+	struct relay_net_slot slots[RELAY_NET_DEPTH];
+	u64 seq;
+	wait_queue_head_t wait;
+	struct task_struct *receiver;
+};
+
+/* a copy of a bio for one mirror member, allocated as front padding */
+struct relay_mirror_io {
+	struct relay_dev *dev;
+	struct bio *parent;
+	unsigned int member;
+	u64 start;
+	struct bio clone;
+};
+
+struct relay_io;
+typedef void (*relay_io_end_t)(struct relay_io *rio, blk_status_t status);
+
+/* an engine I/O, allocated as front padding of its bio */
+struct relay_io {
+	struct relay_dev *dev;
+	relay_io_end_t end_io;
+	void *private;
+	/* the bio as submitted, restored before end_io */
+	struct bvec_iter iter;
+	/* write generations seen when a readahead was sent */
+	u64 cache_gen;
+	struct bio bio;
+};
+
+static int relay_major;
+
+/*
+ * Mirror retries, stripe flush ordering, readahead and coalesced writes
+ * all submit I/O from work items; writeback may depend on them, so they
+ * run on a workqueue with a rescuer instead of the system one.
+ */
+static struct workqueue_struct *relay_wq;
+
+/* all relays, by creation order */
+static LIST_HEAD(relay_devs);
+static DEFINE_MUTEX(relay_lock);
+static DEFINE_IDA(relay_ida);
+/* the phys_disk relay, target of the test bios */
+static struct relay_dev *test_dev;
+
+/* Find the member holding a relay sector and its sector there */
+static struct relay_member *relay_stripe_map(struct relay_dev *dev,
+		sector_t *sector)
+{
+	sector_t chunk = *sector;
+	unsigned int in_chunk, member;
+
+	in_chunk = sector_div(chunk, dev->chunk_sectors);
+	member = sector_div(chunk, dev->nr_members);
+	*sector = chunk * dev->chunk_sectors + in_chunk;
+
+	return &dev->members[member];
+}
+
+static bool relay_mirror_healthy(struct relay_dev *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->nr_members; i++)
+		if (!test_bit(RELAY_MEMBER_FAILED, &dev->members[i].flags))
+			return true;
+	return false;
+}
+
+/*
+ * Pick the member for a read: a rotating disk whose head sits right where
+ * the read starts keeps its sequential stream, otherwise the least busy
+ * member wins, the closest to its last I/O among equally busy ones.
+ */
+static int relay_mirror_pick(struct relay_dev *dev, sector_t sector)
+{
+	unsigned int i, pending, best_pending = 0;
+	sector_t head, dist, best_dist = 0;
+	struct relay_member *m;
+	int best = -1;
+
+	for (i = 0; i < dev->nr_members; i++) {
+		m = &dev->members[i];
+		if (test_bit(RELAY_MEMBER_FAILED, &m->flags))
+			continue;
+		pending = atomic_read(&m->inflight);
+		head = READ_ONCE(m->head);
+		dist = head > sector ? head - sector : sector - head;
+		if (!dist && !dev->nonrot)
+			return i;
+		if (best < 0 || pending < best_pending ||
+				(pending == best_pending && dist < best_dist)) {
+			best = i;
+			best_pending = pending;
+			best_dist = dist;
+		}
 	}
 
-	/* Submit bio and wait for completion */
-	submit_bio_wait(bio);
+	return best;
+}
 
-	/* Read data (first 3 bytes) from bio buffer and print it */
-	buf = kmap_atomic(page);
-	printk("from bio buffer:\n");
-	for (i=0; i<4; i++)
-		printk("%dth byte = % 02x", i, buf[i]);
-	kunmap_atomic(buf);
+static void relay_mirror_issue(struct relay_dev *dev, struct bio *parent,
+		unsigned int member, bio_end_io_t *end_io)
+{
+	struct relay_member *m = &dev->members[member];
+	struct relay_mirror_io *mio;
+	struct bio *clone;
+
+	clone = bio_clone_fast(parent, GFP_NOIO, &dev->split_set);
+	mio = container_of(clone, struct relay_mirror_io, clone);
+	mio->dev = dev;
+	mio->parent = parent;
+	mio->member = member;
+	mio->start = ktime_get_ns();
+	bio_set_dev(clone, m->bdev);
+	clone->bi_end_io = end_io;
 
-	bio_put(bio);
-	__free_page(page);
+	atomic_inc(&m->inflight);
+	if (bio_sectors(clone))
+		WRITE_ONCE(m->head, bio_end_sector(clone));
+	generic_make_request(clone);
 }
 
-static struct block_device *open_disk(char *name)
+/* errors that say nothing about the health of the member */
+static bool relay_mirror_fault(blk_status_t status)
 {
-	struct block_device *bdev;
+	return status && status != BLK_STS_NOTSUPP && status != BLK_STS_AGAIN;
+}
 
-	/* Get block device in exclusive mode */
-	bdev = blkdev_get_by_path(name, 
-			FMODE_READ | FMODE_WRITE | FMODE_EXCL, THIS_MODULE);
+/* Account a finished copy; a member that fails an I/O leaves the mirror */
+static void relay_mirror_done(struct relay_mirror_io *mio)
+{
+	struct relay_member *m = &mio->dev->members[mio->member];
 
-	return bdev;
+	atomic64_add(ktime_get_ns() - mio->start, &m->lat_ns);
+	atomic64_inc(&m->ios);
+	atomic_dec(&m->inflight);
+
+	if (relay_mirror_fault(mio->clone.bi_status) &&
+			!test_and_set_bit(RELAY_MEMBER_FAILED, &m->flags))
+		printk(KERN_ERR "%s failed with %d, mirror degraded\n",
+				m->path,
+				blk_status_to_errno(mio->clone.bi_status));
 }
 
-static int __init relay_init(void)
+static void relay_mirror_write_end(struct bio *clone)
 {
-	phys_bdev = open_disk(PHYSICAL_DISK_NAME);
-	if (phys_bdev == NULL) {
-		printk(KERN_ERR "[relay_init] No such device\n");
-		return -EINVAL;
+	struct relay_mirror_io *mio = container_of(clone,
+			struct relay_mirror_io, clone);
+	struct relay_dev *dev = mio->dev;
+	struct bio *parent = mio->parent;
+
+	relay_mirror_done(mio);
+
+	/* the write stands while a member still holds it */
+	if (clone->bi_status && (!relay_mirror_fault(clone->bi_status) ||
+				!relay_mirror_healthy(dev)))
+		parent->bi_status = clone->bi_status;
+	bio_put(clone);
+	bio_endio(parent);
+}
+
+static void relay_mirror_read_end(struct bio *clone)
+{
+	struct relay_mirror_io *mio = container_of(clone,
+			struct relay_mirror_io, clone);
+	struct relay_dev *dev = mio->dev;
+	struct bio *parent = mio->parent;
+	unsigned long flags;
+
+	relay_mirror_done(mio);
+
+	/* submitting needs process context, retry from a work item */
+	if (relay_mirror_fault(clone->bi_status) && relay_mirror_healthy(dev)) {
+		bio_put(clone);
+		spin_lock_irqsave(&dev->retry_lock, flags);
+		bio_list_add(&dev->retry, parent);
+		spin_unlock_irqrestore(&dev->retry_lock, flags);
+		queue_work(relay_wq, &dev->retry_work);
+		return;
+	}
+
+	parent->bi_status = clone->bi_status;
+	bio_put(clone);
+	bio_endio(parent);
+}
+
+static void relay_mirror_read(struct relay_dev *dev, struct bio *bio)
+{
+	int member;
+
+	member = relay_mirror_pick(dev, bio->bi_iter.bi_sector);
+	if (member < 0) {
+		bio_io_error(bio);
+		return;
+	}
+	relay_mirror_issue(dev, bio, member, relay_mirror_read_end);
+}
+
+static void relay_mirror_retry(struct work_struct *work)
+{
+	struct relay_dev *dev = container_of(work, struct relay_dev,
+			retry_work);
+	struct bio *bio;
+
+	for (;;) {
+		spin_lock_irq(&dev->retry_lock);
+		bio = bio_list_pop(&dev->retry);
+		spin_unlock_irq(&dev->retry_lock);
+		if (!bio)
+			break;
+		relay_mirror_read(dev, bio);
+	}
+}
+
+/*
+ * Reads go to a single member. Writes, flushes and discards go to every
+ * member still in the mirror, each copy holding a reference on the bio.
+ */
+static void relay_mirror_submit(struct relay_dev *dev, struct bio *bio)
+{
+	unsigned int i, copies = 0;
+
+	if (!op_is_write(bio_op(bio))) {
+		relay_mirror_read(dev, bio);
+		return;
 	}
 
-	send_test_bio(phys_bdev, REQ_OP_READ);
+	for (i = 0; i < dev->nr_members; i++) {
+		if (test_bit(RELAY_MEMBER_FAILED, &dev->members[i].flags))
+			continue;
+		bio_inc_remaining(bio);
+		relay_mirror_issue(dev, bio, i, relay_mirror_write_end);
+		copies++;
+	}
+
+	if (!copies)
+		bio->bi_status = BLK_STS_IOERR;
+	bio_endio(bio);
+}
+
+static int relay_net_xmit(struct socket *sock, void *buf, size_t len,
+		int flags)
+{
+	struct msghdr msg = { .msg_flags = MSG_NOSIGNAL | flags };
+	struct kvec iov;
+	int ret;
+
+	while (len) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		ret = kernel_sendmsg(sock, &msg, &iov, 1, len);
+		if (ret <= 0)
+			return ret ? ret : -EPIPE;
+		buf += ret;
+		len -= ret;
+	}
 
 	return 0;
 }
 
-static void close_disk(struct block_device *bdev)
+static int relay_net_recv(struct socket *sock, void *buf, size_t len)
 {
-	/* Put block device */
-	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+	struct kvec iov = { .iov_base = buf, .iov_len = len };
+	int ret;
+
+	ret = kernel_recvmsg(sock, &msg, &iov, 1, len, MSG_WAITALL);
+	if (ret == len)
+		return 0;
+	return ret < 0 ? ret : -ECONNRESET;
 }
 
-static void __exit relay_exit(void)
+/* Take a free slot for bio: -EBUSY if there is none, -EPIPE if lost */
+static int relay_net_claim(struct relay_conn *conn, struct bio *bio)
 {
-	/* Send test write bio */
-	send_test_bio(phys_bdev, REQ_OP_WRITE);
-	close_disk(phys_bdev);
+	struct relay_net_slot *s;
+	int slot;
+
+	spin_lock(&conn->lock);
+	if (conn->dead) {
+		slot = -EPIPE;
+		goto out;
+	}
+	slot = find_first_zero_bit(conn->busy, RELAY_NET_DEPTH);
+	if (slot == RELAY_NET_DEPTH) {
+		slot = -EBUSY;
+		goto out;
+	}
+	__set_bit(slot, conn->busy);
+	s = &conn->slots[slot];
+	s->bio = bio;
+	s->tag = conn->seq++ * RELAY_NET_DEPTH + slot;
+	atomic_set(&s->refs, 2);
+	s->replied = false;
+	s->status = BLK_STS_OK;
+out:
+	spin_unlock(&conn->lock);
+	return slot;
+}
+
+/*
+ * Drop a reference on a slot. The reply can come before the sender is
+ * done with the bio, so whichever of the two is last completes it.
+ */
+static void relay_net_put(struct relay_conn *conn, unsigned int slot)
+{
+	struct relay_net_slot *s = &conn->slots[slot];
+	struct bio *bio = s->bio;
+
+	if (!atomic_dec_and_test(&s->refs))
+		return;
+
+	bio->bi_status = s->status;
+	spin_lock(&conn->lock);
+	s->bio = NULL;
+	__clear_bit(slot, conn->busy);
+	spin_unlock(&conn->lock);
+	wake_up(&conn->wait);
+
+	bio_endio(bio);
+}
+
+static void relay_net_send(struct relay_conn *conn, struct bio *bio,
+		unsigned int slot, u16 op, u16 flags)
+{
+	struct relay_net_req req = {
+		.magic	= cpu_to_be32(RELAY_NET_REQ_MAGIC),
+		.op	= cpu_to_be16(op),
+		.flags	= cpu_to_be16(flags),
+		.tag	= cpu_to_be64(conn->slots[slot].tag),
+		.sector	= cpu_to_be64(bio->bi_iter.bi_sector),
+		.len	= cpu_to_be32(bio->bi_iter.bi_size),
+	};
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	void *buf;
+	int err;
+
+	mutex_lock(&conn->send_lock);
+	err = relay_net_xmit(conn->sock, &req, sizeof(req),
+			op == RELAY_NET_WRITE ? MSG_MORE : 0);
+	if (!err && op == RELAY_NET_WRITE) {
+		bio_for_each_segment(bvec, bio, iter) {
+			buf = kmap(bvec.bv_page);
+			err = relay_net_xmit(conn->sock, buf + bvec.bv_offset,
+					bvec.bv_len, iter.bi_size > bvec.bv_len ?
+					MSG_MORE : 0);
+			kunmap(bvec.bv_page);
+			if (err)
+				break;
+		}
+	}
+	mutex_unlock(&conn->send_lock);
+
+	/* the receiver sees the connection go down and fails the request */
+	if (err)
+		kernel_sock_shutdown(conn->sock, SHUT_RDWR);
+	relay_net_put(conn, slot);
+}
+
+/*
+ * Send a bio to the server on the next connection in turn. A full
+ * connection makes the caller wait for a reply there, a lost one is
+ * skipped, and the bio fails once no connection is left.
+ */
+static void relay_net_submit(struct relay_dev *dev, struct bio *bio)
+{
+	struct relay_conn *conn = NULL;
+	unsigned int i, first;
+	u16 op, flags = 0;
+	int slot = -EPIPE;
+
+	switch (bio_op(bio)) {
+	case REQ_OP_READ:
+		op = RELAY_NET_READ;
+		break;
+	case REQ_OP_WRITE:
+		op = bio_sectors(bio) ? RELAY_NET_WRITE : RELAY_NET_FLUSH;
+		break;
+	case REQ_OP_DISCARD:
+		op = RELAY_NET_DISCARD;
+		break;
+	default:
+		bio->bi_status = BLK_STS_NOTSUPP;
+		bio_endio(bio);
+		return;
+	}
+	if (bio->bi_opf & REQ_PREFLUSH)
+		flags |= RELAY_NET_F_FLUSH;
+	if (bio->bi_opf & REQ_FUA)
+		flags |= RELAY_NET_F_FUA;
+
+	first = atomic_inc_return(&dev->net_next);
+	for (i = 0; i < dev->nr_conns && slot < 0; i++) {
+		conn = &dev->conns[(first + i) % dev->nr_conns];
+		wait_event(conn->wait,
+				(slot = relay_net_claim(conn, bio)) != -EBUSY);
+	}
+	if (slot < 0) {
+		bio_io_error(bio);
+		return;
+	}
+
+	relay_net_send(conn, bio, slot, op, flags);
+}
+
+/* Fail every request still waiting for a reply on a lost connection */
+static void relay_net_fail(struct relay_conn *conn)
+{
+	struct relay_net_slot *s;
+	unsigned int slot;
+	bool pending;
+
+	spin_lock(&conn->lock);
+	conn->dead = true;
+	spin_unlock(&conn->lock);
+	wake_up_all(&conn->wait);
+	/* a sender blocked on a full socket gives up as well */
+	kernel_sock_shutdown(conn->sock, SHUT_RDWR);
+
+	for (slot = 0; slot < RELAY_NET_DEPTH; slot++) {
+		s = &conn->slots[slot];
+		spin_lock(&conn->lock);
+		pending = test_bit(slot, conn->busy) && !s->replied;
+		spin_unlock(&conn->lock);
+		if (!pending)
+			continue;
+		s->status = BLK_STS_IOERR;
+		s->replied = true;
+		relay_net_put(conn, slot);
+	}
+}
+
+/* Match replies to their requests and complete them, until the end */
+static int relay_net_receiver(void *data)
+{
+	struct relay_conn *conn = data;
+	struct relay_net_reply reply;
+	struct relay_net_slot *s;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	struct bio *bio;
+	unsigned int slot;
+	u32 error;
+	void *buf;
+	u64 tag;
+	int err;
+
+	for (;;) {
+		err = relay_net_recv(conn->sock, &reply, sizeof(reply));
+		if (err)
+			break;
+
+		tag = be64_to_cpu(reply.tag);
+		slot = tag % RELAY_NET_DEPTH;
+		s = &conn->slots[slot];
+		spin_lock(&conn->lock);
+		bio = test_bit(slot, conn->busy) && !s->replied &&
+			s->tag == tag ? s->bio : NULL;
+		spin_unlock(&conn->lock);
+		if (be32_to_cpu(reply.magic) != RELAY_NET_REPLY_MAGIC || !bio) {
+			err = -EPROTO;
+			break;
+		}
+
+		error = be32_to_cpu(reply.error);
+		if (!error && bio_op(bio) == REQ_OP_READ) {
+			bio_for_each_segment(bvec, bio, iter) {
+				buf = kmap(bvec.bv_page);
+				err = relay_net_recv(conn->sock,
+						buf + bvec.bv_offset,
+						bvec.bv_len);
+				kunmap(bvec.bv_page);
+				if (err)
+					break;
+			}
+			if (err)
+				break;
+		}
+
+		s->status = error ? errno_to_blk_status(-(int)error) :
+			BLK_STS_OK;
+		s->replied = true;
+		relay_net_put(conn, slot);
+	}
+
+	if (!READ_ONCE(conn->dead))
+		printk(KERN_ERR RELAY_BLKDEV_NAME "%d: connection %u to "
+				"%pISpc lost: %d\n", conn->dev->index,
+				conn->index, &conn->dev->net_addr, err);
+	relay_net_fail(conn);
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+/* Connect to the server and read its hello, which gives the size */
+static int relay_net_connect(struct relay_dev *dev, struct relay_conn *conn)
+{
+	struct relay_net_hello hello;
+	struct socket *sock;
+	sector_t nr_sectors;
+	int one = 1;
+	int err;
+
+	err = sock_create_kern(&init_net, PF_INET, SOCK_STREAM, IPPROTO_TCP,
+			&sock);
+	if (err < 0) {
+		printk(KERN_ERR "error in creating socket\n");
+		return err;
+	}
+	/* the socket carries block I/O, it must not recurse into it */
+	sock->sk->sk_allocation = GFP_NOIO;
+	sk_set_memalloc(sock->sk);
+
+	err = kernel_connect(sock, (struct sockaddr *)&dev->net_addr,
+			sizeof(dev->net_addr), 0);
+	if (err < 0) {
+		printk(KERN_ERR "error in connecting to %pISpc\n",
+				&dev->net_addr);
+		goto out_release;
+	}
+	kernel_setsockopt(sock, SOL_TCP, TCP_NODELAY, (char *)&one,
+			sizeof(one));
+
+	err = relay_net_recv(sock, &hello, sizeof(hello));
+	if (err < 0 || be32_to_cpu(hello.magic) != RELAY_NET_HELLO_MAGIC) {
+		printk(KERN_ERR "no hello from %pISpc\n", &dev->net_addr);
+		err = -EPROTO;
+		goto out_release;
+	}
+	nr_sectors = be64_to_cpu(hello.nr_sectors);
+	if (!nr_sectors || (dev->nr_sectors && dev->nr_sectors != nr_sectors)) {
+		printk(KERN_ERR "%pISpc has a bad size\n", &dev->net_addr);
+		err = -EPROTO;
+		goto out_release;
+	}
+	dev->nr_sectors = nr_sectors;
+	dev->net_flags = be32_to_cpu(hello.flags);
+
+	conn->dev = dev;
+	conn->sock = sock;
+	mutex_init(&conn->send_lock);
+	spin_lock_init(&conn->lock);
+	init_waitqueue_head(&conn->wait);
+	conn->receiver = kthread_run(relay_net_receiver, conn,
+			RELAY_BLKDEV_NAME "%d-net%u", dev->index, conn->index);
+	if (IS_ERR(conn->receiver)) {
+		err = PTR_ERR(conn->receiver);
+		conn->receiver = NULL;
+		conn->sock = NULL;
+		goto out_release;
+	}
+
+	return 0;
+
+out_release:
+	sock_release(sock);
+	return err;
+}
+
+static void relay_net_close(struct relay_dev *dev)
+{
+	struct relay_conn *conn;
+	unsigned int i;
+
+	for (i = 0; i < dev->nr_conns; i++) {
+		conn = &dev->conns[i];
+		if (!conn->sock)
+			continue;
+		WRITE_ONCE(conn->dead, true);
+		kernel_sock_shutdown(conn->sock, SHUT_RDWR);
+		kthread_stop(conn->receiver);
+		sock_release(conn->sock);
+	}
+	kfree(dev->conns);
+	dev->conns = NULL;
+}
+
+static int relay_net_open(struct relay_dev *dev)
+{
+	unsigned int i;
+	int err;
+
+	dev->conns = kcalloc(dev->nr_conns, sizeof(*dev->conns), GFP_KERNEL);
+	if (!dev->conns)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->nr_conns; i++) {
+		dev->conns[i].index = i;
+		err = relay_net_connect(dev, &dev->conns[i]);
+		if (err) {
+			relay_net_close(dev);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The member flushes of a stripe PREFLUSH are done. The data may only go
+ * out now, but submitting needs process context: hand it to a work item.
+ * The flush parent comes from the split set, whose front padding holds
+ * the relay and the bio waiting for the flushes.
+ */
+static void relay_stripe_preflush_end(struct bio *flush)
+{
+	struct relay_mirror_io *fio = container_of(flush,
+			struct relay_mirror_io, clone);
+	struct relay_dev *dev = fio->dev;
+	struct bio *bio = fio->parent;
+	unsigned long flags;
+
+	if (flush->bi_status || !bio_sectors(bio)) {
+		bio->bi_status = flush->bi_status;
+		bio_put(flush);
+		bio_endio(bio);
+		return;
+	}
+	bio_put(flush);
+
+	spin_lock_irqsave(&dev->preflush_lock, flags);
+	bio_list_add(&dev->preflushed, bio);
+	spin_unlock_irqrestore(&dev->preflush_lock, flags);
+	queue_work(relay_wq, &dev->preflush_work);
+}
+
+/*
+ * Flush every member under a parent of their own, the bio itself is only
+ * submitted once all of them have completed, as a member must not see the
+ * data before the others have made the earlier writes stable.
+ */
+static void relay_stripe_preflush(struct relay_dev *dev, struct bio *bio)
+{
+	struct relay_mirror_io *fio;
+	struct bio *flush, *split;
+	unsigned int i;
+
+	bio->bi_opf &= ~REQ_PREFLUSH;
+
+	flush = bio_alloc_bioset(GFP_NOIO, 0, &dev->split_set);
+	fio = container_of(flush, struct relay_mirror_io, clone);
+	fio->dev = dev;
+	fio->parent = bio;
+	flush->bi_end_io = relay_stripe_preflush_end;
+
+	for (i = 0; i < dev->nr_members; i++) {
+		split = bio_alloc_bioset(GFP_NOIO, 0, &dev->split_set);
+		bio_set_dev(split, dev->members[i].bdev);
+		split->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH;
+		bio_chain(split, flush);
+		generic_make_request(split);
+	}
+	/* drop the reference the parent started with */
+	bio_endio(flush);
+}
+
+/*
+ * Send a bio addressed in relay sectors to the members. Stripes split it
+ * at chunk boundaries and the fragments, chained to it, go out together;
+ * its end_io runs once all of them are done.
+ */
+static void relay_submit(struct relay_dev *dev, struct bio *bio)
+{
+	struct relay_member *m;
+	struct bio *split;
+	unsigned int left;
+	sector_t chunk;
+
+	if (dev->layout == RELAY_LINEAR) {
+		bio_set_dev(bio, dev->members[0].bdev);
+		bio->bi_iter.bi_sector += dev->offset;
+		generic_make_request(bio);
+		return;
+	}
+
+	if (dev->layout == RELAY_MIRROR) {
+		relay_mirror_submit(dev, bio);
+		return;
+	}
+
+	if (dev->layout == RELAY_NET) {
+		relay_net_submit(dev, bio);
+		return;
+	}
+
+	/* earlier writes may sit on any member, so flush all of them first */
+	if (bio->bi_opf & REQ_PREFLUSH) {
+		relay_stripe_preflush(dev, bio);
+		return;
+	}
+
+	do {
+		chunk = bio->bi_iter.bi_sector;
+		left = dev->chunk_sectors - sector_div(chunk, dev->chunk_sectors);
+		if (bio_sectors(bio) > left) {
+			split = bio_split(bio, left, GFP_NOIO, &dev->split_set);
+			bio_chain(split, bio);
+		} else {
+			split = bio;
+		}
+		m = relay_stripe_map(dev, &split->bi_iter.bi_sector);
+		bio_set_dev(split, m->bdev);
+		generic_make_request(split);
+	} while (split != bio);
+}
+
+static void relay_stripe_preflushed(struct work_struct *work)
+{
+	struct relay_dev *dev = container_of(work, struct relay_dev,
+			preflush_work);
+	struct bio *bio;
+
+	for (;;) {
+		spin_lock_irq(&dev->preflush_lock);
+		bio = bio_list_pop(&dev->preflushed);
+		spin_unlock_irq(&dev->preflush_lock);
+		if (!bio)
+			break;
+		relay_submit(dev, bio);
+	}
+}
+
+/*
+ * Allocate an I/O of size bytes backed by pool pages. Never fails, but
+ * may sleep until earlier I/Os give their pages back.
+ */
+static struct relay_io *relay_io_alloc(struct relay_dev *dev, unsigned int op,
+		sector_t sector, unsigned int size)
+{
+	unsigned int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	struct relay_io *rio;
+	struct bio *bio;
+	unsigned int len;
+
+	WARN_ON(nr_pages > RELAY_IO_MAX_PAGES);
+
+	bio = bio_alloc_bioset(GFP_NOIO, nr_pages, &dev->io_bio_set);
+	rio = container_of(bio, struct relay_io, bio);
+	rio->dev = dev;
+
+	/* Fill bio (sector, direction), relay_submit picks the members */
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_opf = op;
+
+	/* one allocator at a time, so partial sets cannot drain the pool */
+	mutex_lock(&dev->io_alloc_lock);
+	while (size) {
+		len = min_t(unsigned int, size, PAGE_SIZE);
+		bio_add_page(bio, mempool_alloc(dev->page_pool, GFP_NOIO),
+				len, 0);
+		size -= len;
+	}
+	mutex_unlock(&dev->io_alloc_lock);
+
+	return rio;
+}
+
+static void relay_io_free(struct relay_io *rio)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	bio_for_each_segment_all(bvec, &rio->bio, i)
+		mempool_free(bvec->bv_page, rio->dev->page_pool);
+	bio_put(&rio->bio);
+}
+
+static void relay_io_end(struct bio *bio)
+{
+	struct relay_io *rio = container_of(bio, struct relay_io, bio);
+	struct relay_dev *dev = rio->dev;
+	unsigned long flags;
+
+	bio->bi_iter = rio->iter;
+	rio->end_io(rio, bio->bi_status);
+	relay_io_free(rio);
+
+	/* relay_io_drain takes io_lock so dev outlives this wake up */
+	spin_lock_irqsave(&dev->io_lock, flags);
+	atomic_dec(&dev->io_inflight);
+	wake_up(&dev->io_wait);
+	spin_unlock_irqrestore(&dev->io_lock, flags);
+}
+
+/*
+ * Submit without waiting for completion, once fewer than io_depth engine
+ * I/Os are in flight. end_io runs in bio completion context, before the
+ * pages go back to the pool.
+ */
+static void relay_io_submit(struct relay_io *rio, relay_io_end_t end_io,
+		void *private)
+{
+	struct relay_dev *dev = rio->dev;
+
+	rio->end_io = end_io;
+	rio->private = private;
+	rio->iter = rio->bio.bi_iter;
+	rio->bio.bi_end_io = relay_io_end;
+
+	wait_event(dev->io_wait,
+			atomic_add_unless(&dev->io_inflight, 1, io_depth));
+	relay_submit(dev, &rio->bio);
+}
+
+static void relay_io_drain(struct relay_dev *dev)
+{
+	wait_event(dev->io_wait, !atomic_read(&dev->io_inflight));
+	spin_lock_irq(&dev->io_lock);
+	spin_unlock_irq(&dev->io_lock);
+}
+
+static void test_bio_end(struct relay_io *rio, blk_status_t status)
+{
+	char *buf;
+	int i;
+
+	if (status) {
+		printk(KERN_ERR "test bio failed: %d\n",
+				blk_status_to_errno(status));
+		return;
+	}
+
+	/* Read data (first 3 bytes) from bio buffer and print it */
+	buf = kmap_atomic(rio->bio.bi_io_vec[0].bv_page);
+	printk("from bio buffer:\n");
+	for (i=0; i<4; i++)
+		printk("%dth byte = % 02x", i, buf[i]);
+	kunmap_atomic(buf);
+}
+
+static void send_test_bio(struct relay_dev *dev, int dir)
+{
+	struct relay_io *rio;
+	char *buf;
+
+	rio = relay_io_alloc(dev, dir ? REQ_OP_WRITE : REQ_OP_READ, 0,
+			KERNEL_SECTOR_SIZE);
+
+	/* Write message to bio buffer if direction is write */
+	if (dir == REQ_OP_WRITE) {
+		buf = kmap_atomic(rio->bio.bi_io_vec[0].bv_page);
+		memcpy(buf, BIO_WRITE_MESSAGE, 3);
+		kunmap_atomic(buf);
+	}
+
+	/* Submit bio, the buffer is printed on completion */
+	relay_io_submit(rio, test_bio_end, NULL);
+}
+
+static struct block_device *open_disk(const char *name, void *holder)
+{
+	struct block_device *bdev;
+
+	/* Get block device in exclusive mode */
+	bdev = blkdev_get_by_path(name, 
+			FMODE_READ | FMODE_WRITE | FMODE_EXCL, holder);
+
+	return bdev;
+}
+
+static void close_disk(struct block_device *bdev)
+{
+	/* Put block device */
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+}
+
+static int relay_open(struct block_device *bdev, fmode_t mode)
+{
+	struct relay_dev *dev = bdev->bd_disk->private_data;
+	int err = 0;
+
+	mutex_lock(&relay_lock);
+	if (dev->deleting)
+		err = -ENXIO;
+	else
+		dev->open_count++;
+	mutex_unlock(&relay_lock);
+
+	return err;
+}
+
+static void relay_release(struct gendisk *gd, fmode_t mode)
+{
+	struct relay_dev *dev = gd->private_data;
+
+	mutex_lock(&relay_lock);
+	dev->open_count--;
+	mutex_unlock(&relay_lock);
+}
+
+static const struct block_device_operations relay_ops = {
+	.owner = THIS_MODULE,
+	.open = relay_open,
+	.release = relay_release,
+};
+
+/*
+ * Sum of the write generations covering [start, end) sectors. They only
+ * grow, so an unchanged sum means no write touched the range meanwhile.
+ */
+static u64 relay_cache_gen(struct relay_dev *dev, sector_t start,
+		sector_t end)
+{
+	pgoff_t first = start >> (RELAY_CBLOCK_SHIFT + RELAY_GEN_SHIFT);
+	pgoff_t last = (end - 1) >> (RELAY_CBLOCK_SHIFT + RELAY_GEN_SHIFT);
+	u64 sum = 0;
+	pgoff_t i;
+
+	if (last - first >= RELAY_CACHE_GENS)
+		last = first + RELAY_CACHE_GENS - 1;
+	for (i = first; i <= last; i++)
+		sum += dev->cache_gen[i % RELAY_CACHE_GENS];
+
+	return sum;
+}
+
+static void relay_cache_unlink(struct relay_dev *dev, struct relay_cblock *cb)
+{
+	list_del(&cb->list);
+	dev->cache_len[cb->queue]--;
+}
+
+static void relay_cache_link(struct relay_dev *dev, struct relay_cblock *cb,
+		int queue)
+{
+	cb->queue = queue;
+	list_add(&cb->list, &dev->cache_lists[queue]);
+	dev->cache_len[queue]++;
+}
+
+static void relay_cache_drop(struct relay_dev *dev, struct relay_cblock *cb)
+{
+	relay_cache_unlink(dev, cb);
+	radix_tree_delete(&dev->cache, cb->index);
+	if (cb->page)
+		__free_page(cb->page);
+	kfree(cb);
+}
+
+/*
+ * Make room for one more block. A1in over its target loses its oldest
+ * block to the A1out ghosts, otherwise the least recently used hot block
+ * goes. One-time scans therefore never push out the hot set.
+ */
+static void relay_cache_reclaim(struct relay_dev *dev)
+{
+	struct relay_cblock *cb;
+
+	while (dev->cache_len[RELAY_A1IN] + dev->cache_len[RELAY_AM] >=
+			dev->cache_budget) {
+		if (dev->cache_len[RELAY_A1IN] > dev->cache_kin ||
+				list_empty(&dev->cache_lists[RELAY_AM])) {
+			cb = list_last_entry(&dev->cache_lists[RELAY_A1IN],
+					struct relay_cblock, list);
+			relay_cache_unlink(dev, cb);
+			__free_page(cb->page);
+			cb->page = NULL;
+			relay_cache_link(dev, cb, RELAY_A1OUT);
+			if (dev->cache_len[RELAY_A1OUT] > dev->cache_kout)
+				relay_cache_drop(dev, list_last_entry(
+						&dev->cache_lists[RELAY_A1OUT],
+						struct relay_cblock, list));
+		} else {
+			cb = list_last_entry(&dev->cache_lists[RELAY_AM],
+					struct relay_cblock, list);
+			relay_cache_drop(dev, cb);
+		}
+		dev->cache_evictions++;
+	}
+}
+
+/*
+ * Copy between the bio data and the cached blocks it covers, skipping
+ * blocks without data. The bio iterator is left untouched.
+ */
+static void relay_cache_copy(struct relay_dev *dev, struct bio *bio,
+		bool to_cache)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	struct relay_cblock *cb;
+	unsigned int len, chunk, boff;
+	sector_t sector;
+	u8 *base, *mem, *cmem;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		sector = iter.bi_sector;
+		len = bvec.bv_len;
+		base = kmap_atomic(bvec.bv_page);
+		mem = base + bvec.bv_offset;
+		while (len) {
+			boff = (sector & (RELAY_CBLOCK_SECTORS - 1)) <<
+				SECTOR_SHIFT;
+			chunk = min_t(unsigned int, len, PAGE_SIZE - boff);
+			cb = radix_tree_lookup(&dev->cache,
+					sector >> RELAY_CBLOCK_SHIFT);
+			if (cb && cb->page) {
+				cmem = kmap_atomic(cb->page);
+				if (to_cache)
+					memcpy(cmem + boff, mem, chunk);
+				else
+					memcpy(mem, cmem + boff, chunk);
+				kunmap_atomic(cmem);
+			}
+			sector += chunk >> SECTOR_SHIFT;
+			mem += chunk;
+			len -= chunk;
+		}
+		kunmap_atomic(base);
+	}
+}
+
+/*
+ * Serve a read from the cache when every block it touches is cached.
+ * On a miss, *gen is what relay_cache_fill checks on completion.
+ */
+static bool relay_cache_read(struct relay_dev *dev, struct bio *bio, u64 *gen)
+{
+	sector_t sector = bio->bi_iter.bi_sector;
+	sector_t end = bio_end_sector(bio);
+	struct relay_cblock *cb;
+	unsigned long flags;
+	pgoff_t idx;
+
+	spin_lock_irqsave(&dev->cache_lock, flags);
+	for (idx = sector >> RELAY_CBLOCK_SHIFT;
+			idx <= (end - 1) >> RELAY_CBLOCK_SHIFT; idx++) {
+		cb = radix_tree_lookup(&dev->cache, idx);
+		if (!cb || !cb->page)
+			goto miss;
+	}
+
+	relay_cache_copy(dev, bio, false);
+	for (idx = sector >> RELAY_CBLOCK_SHIFT;
+			idx <= (end - 1) >> RELAY_CBLOCK_SHIFT; idx++) {
+		cb = radix_tree_lookup(&dev->cache, idx);
+		if (cb->queue == RELAY_AM)
+			list_move(&cb->list, &dev->cache_lists[RELAY_AM]);
+	}
+	dev->cache_hits++;
+	spin_unlock_irqrestore(&dev->cache_lock, flags);
+	return true;
+
+miss:
+	dev->cache_misses++;
+	*gen = relay_cache_gen(dev, sector, end);
+	spin_unlock_irqrestore(&dev->cache_lock, flags);
+	return false;
+}
+
+/*
+ * Insert the blocks a completed read fully covers, unless a write to
+ * the range was sent since the read was. Runs in completion context, so
+ * allocations do not wait and failing ones just leave blocks uncached.
+ */
+static void relay_cache_fill(struct relay_dev *dev, struct bio *bio, u64 gen)
+{
+	sector_t sector = bio->bi_iter.bi_sector;
+	sector_t end = bio_end_sector(bio);
+	pgoff_t first = DIV_ROUND_UP_SECTOR_T(sector, RELAY_CBLOCK_SECTORS);
+	pgoff_t last = end >> RELAY_CBLOCK_SHIFT;
+	struct relay_cblock *cb;
+	unsigned long flags;
+	struct page *page;
+	pgoff_t idx;
+
+	if (first >= last)
+		return;
+
+	spin_lock_irqsave(&dev->cache_lock, flags);
+	if (relay_cache_gen(dev, sector, end) != gen)
+		goto out;
+
+	for (idx = first; idx < last; idx++) {
+		cb = radix_tree_lookup(&dev->cache, idx);
+		if (cb && cb->page)
+			continue;
+
+		page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+		if (!page)
+			break;
+		relay_cache_reclaim(dev);
+
+		/* reclaim may have dropped the ghost of this block */
+		cb = radix_tree_lookup(&dev->cache, idx);
+
+		/* a ghost hit means the block is reused, it goes hot */
+		if (cb) {
+			relay_cache_unlink(dev, cb);
+			cb->page = page;
+			relay_cache_link(dev, cb, RELAY_AM);
+			continue;
+		}
+
+		cb = kmalloc(sizeof(*cb), GFP_NOWAIT | __GFP_NOWARN);
+		if (!cb) {
+			__free_page(page);
+			break;
+		}
+		cb->index = idx;
+		cb->page = page;
+		if (radix_tree_insert(&dev->cache, idx, cb)) {
+			__free_page(page);
+			kfree(cb);
+			break;
+		}
+		relay_cache_link(dev, cb, RELAY_A1IN);
+	}
+
+	/* blocks cached before are refreshed with the same, current data */
+	relay_cache_copy(dev, bio, true);
+out:
+	spin_unlock_irqrestore(&dev->cache_lock, flags);
+}
+
+/* Drop cached data overlapping [start, end) and bump its generations */
+static void relay_cache_invalidate(struct relay_dev *dev, sector_t start,
+		sector_t end)
+{
+	struct relay_cblock *batch[16];
+	pgoff_t idx = start >> RELAY_CBLOCK_SHIFT;
+	pgoff_t last = (end - 1) >> RELAY_CBLOCK_SHIFT;
+	unsigned long flags;
+	unsigned int nr, i;
+	pgoff_t g;
+
+	spin_lock_irqsave(&dev->cache_lock, flags);
+	for (g = idx >> RELAY_GEN_SHIFT; g <= last >> RELAY_GEN_SHIFT &&
+			g - (idx >> RELAY_GEN_SHIFT) < RELAY_CACHE_GENS; g++)
+		dev->cache_gen[g % RELAY_CACHE_GENS]++;
+
+	while (idx <= last) {
+		nr = radix_tree_gang_lookup(&dev->cache, (void **)batch, idx,
+				ARRAY_SIZE(batch));
+		if (!nr)
+			break;
+		for (i = 0; i < nr && batch[i]->index <= last; i++) {
+			/* ghosts keep the access history, they hold no data */
+			if (batch[i]->page)
+				relay_cache_drop(dev, batch[i]);
+		}
+		if (i < nr)
+			break;
+		idx = batch[nr - 1]->index + 1;
+	}
+	spin_unlock_irqrestore(&dev->cache_lock, flags);
+}
+
+static void relay_cache_init(struct relay_dev *dev)
+{
+	int i;
+
+	spin_lock_init(&dev->cache_lock);
+	INIT_RADIX_TREE(&dev->cache, GFP_ATOMIC);
+	for (i = 0; i < ARRAY_SIZE(dev->cache_lists); i++)
+		INIT_LIST_HEAD(&dev->cache_lists[i]);
+
+	/* readahead lands in A1in, which must hold every stream's window */
+	dev->cache_budget = (unsigned long)cache_mb << (20 - PAGE_SHIFT);
+	if (dev->ra_max)
+		dev->cache_budget = max(dev->cache_budget,
+				4UL * RELAY_RA_STREAMS * dev->ra_max);
+
+	/* the usual 2Q split: A1in a quarter, ghosts for half the budget */
+	dev->cache_kin = dev->cache_budget / 4;
+	dev->cache_kout = dev->cache_budget / 2;
+}
+
+static void relay_cache_free(struct relay_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(dev->cache_lists); i++)
+		while (!list_empty(&dev->cache_lists[i]))
+			relay_cache_drop(dev, list_first_entry(
+					&dev->cache_lists[i],
+					struct relay_cblock, list));
+}
+
+static void relay_wb_free(struct relay_dev *dev)
+{
+	struct relay_dblock *batch[16];
+	unsigned int nr, i;
+
+	while ((nr = radix_tree_gang_lookup(&dev->dirty, (void **)batch, 0,
+					ARRAY_SIZE(batch)))) {
+		for (i = 0; i < nr; i++) {
+			radix_tree_delete(&dev->dirty, batch[i]->index);
+			__free_page(batch[i]->page);
+			kfree(batch[i]);
+		}
+	}
+	dev->nr_dirty = 0;
+}
+
+static void relay_end_io(struct bio *clone)
+{
+	struct relay_clone *rc = container_of(clone, struct relay_clone, clone);
+	struct relay_dev *dev = rc->dev;
+	struct bio *bio = rc->orig;
+
+	/* the original bio still has its own iterator */
+	if (dev->cache_budget && !clone->bi_status && bio_sectors(bio)) {
+		if (bio_op(bio) == REQ_OP_READ)
+			relay_cache_fill(dev, bio, rc->cache_gen);
+		else if (op_is_write(bio_op(bio)))
+			relay_cache_invalidate(dev, bio->bi_iter.bi_sector,
+					bio_end_sector(bio));
+	}
+
+	bio->bi_status = clone->bi_status;
+	bio_put(clone);
+	bio_endio(bio);
+}
+
+static blk_qc_t relay_clone_submit(struct relay_dev *dev, struct bio *bio,
+		u64 gen)
+{
+	struct relay_clone *rc;
+	struct bio *clone;
+
+	/* the lower queue splits the clone to its own limits */
+	clone = bio_clone_fast(bio, GFP_NOIO, &dev->bio_set);
+	if (!clone) {
+		bio_io_error(bio);
+		return BLK_QC_T_NONE;
+	}
+
+	rc = container_of(clone, struct relay_clone, clone);
+	rc->dev = dev;
+	rc->orig = bio;
+	rc->cache_gen = gen;
+	clone->bi_end_io = relay_end_io;
+
+	relay_submit(dev, clone);
+	return BLK_QC_T_NONE;
+}
+
+/* Copy the data of a write into the plug pages */
+static void relay_plug_copy(struct relay_plug *plug, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	unsigned int len, chunk, off;
+	u8 *base, *mem, *pmem;
+	struct page *page;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		off = (iter.bi_sector - plug->start) << SECTOR_SHIFT;
+		len = bvec.bv_len;
+		base = kmap_atomic(bvec.bv_page);
+		mem = base + bvec.bv_offset;
+		while (len) {
+			page = plug->pages[off >> PAGE_SHIFT];
+			chunk = min_t(unsigned int, len,
+					PAGE_SIZE - (off & ~PAGE_MASK));
+			pmem = kmap_atomic(page);
+			memcpy(pmem + (off & ~PAGE_MASK), mem, chunk);
+			kunmap_atomic(pmem);
+			off += chunk;
+			mem += chunk;
+			len -= chunk;
+		}
+		kunmap_atomic(base);
+	}
+}
+
+/* Close the open plug and let the work item submit it; plug_lock held */
+static void relay_plug_dispatch(struct relay_dev *dev)
+{
+	if (!dev->plug)
+		return;
+
+	list_add_tail(&dev->plug->list, &dev->plug_ready);
+	dev->plug = NULL;
+	/*
+	 * A timer callback already running waits for plug_lock, then finds
+	 * no plug and returns; the work queued here submits this one.
+	 */
+	hrtimer_try_to_cancel(&dev->plug_timer);
+	queue_work(relay_wq, &dev->plug_work);
+}
+
+static enum hrtimer_restart relay_plug_timer(struct hrtimer *timer)
+{
+	struct relay_dev *dev = container_of(timer, struct relay_dev,
+			plug_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->plug_lock, flags);
+	relay_plug_dispatch(dev);
+	spin_unlock_irqrestore(&dev->plug_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Add a write to the open plug, or open a new one for it when it neither
+ * overlaps nor follows the run or would grow it past plug_max. Called in
+ * make_request, so nothing here waits: when memory is short the write
+ * is not taken and goes to the target on its own. plug_lock held.
+ */
+static bool relay_plug_add(struct relay_dev *dev, struct bio *bio)
+{
+	sector_t sector = bio->bi_iter.bi_sector;
+	sector_t end = bio_end_sector(bio);
+	struct relay_plug *plug = dev->plug;
+	unsigned int need;
+	struct page *page;
+
+	if (plug && (sector < plug->start || sector > plug->end ||
+			max(plug->end, end) - plug->start > dev->plug_max)) {
+		relay_plug_dispatch(dev);
+		plug = NULL;
+	}
+
+	if (!plug) {
+		plug = kmalloc(sizeof(*plug), GFP_NOWAIT | __GFP_NOWARN);
+		if (!plug)
+			return false;
+		plug->start = plug->end = sector;
+		plug->nr_pages = 0;
+		bio_list_init(&plug->bios);
+		dev->plug = plug;
+		hrtimer_start(&dev->plug_timer,
+				ns_to_ktime((u64)coalesce_us * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+	}
+
+	need = DIV_ROUND_UP((end - plug->start) << SECTOR_SHIFT, PAGE_SIZE);
+	while (plug->nr_pages < need) {
+		page = mempool_alloc(dev->page_pool,
+				GFP_NOWAIT | __GFP_NOWARN);
+		if (!page)
+			goto out_full;
+		plug->pages[plug->nr_pages++] = page;
+	}
+
+	relay_plug_copy(plug, bio);
+	plug->end = max(plug->end, end);
+	bio_list_add(&plug->bios, bio);
+	dev->coalesced_bios++;
+
+	if (plug->end - plug->start >= dev->plug_max)
+		relay_plug_dispatch(dev);
+	return true;
+
+out_full:
+	/* give back the pages only this write needed */
+	need = DIV_ROUND_UP((plug->end - plug->start) << SECTOR_SHIFT,
+			PAGE_SIZE);
+	while (plug->nr_pages > need)
+		mempool_free(plug->pages[--plug->nr_pages], dev->page_pool);
+	if (!bio_list_empty(&plug->bios)) {
+		relay_plug_dispatch(dev);
+		return false;
+	}
+	hrtimer_try_to_cancel(&dev->plug_timer);
+	dev->plug = NULL;
+	kfree(plug);
+	return false;
+}
+
+/*
+ * Take small plain writes into the plug. Flush and FUA bios wait behind
+ * the plugged writes, so they reach the target in the order they came.
+ * Returns false for bios to forward right away.
+ */
+static bool relay_plug(struct relay_dev *dev, struct bio *bio)
+{
+	unsigned long flags;
+	bool taken = false;
+
+	spin_lock_irqsave(&dev->plug_lock, flags);
+	if (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)) {
+		relay_plug_dispatch(dev);
+		if (!list_empty(&dev->plug_ready) || dev->plug_busy) {
+			bio_list_add(&dev->plug_after, bio);
+			queue_work(relay_wq, &dev->plug_work);
+			taken = true;
+		}
+	} else if (bio_op(bio) == REQ_OP_WRITE && bio_sectors(bio) &&
+			bio_sectors(bio) <= dev->plug_max) {
+		taken = relay_plug_add(dev, bio);
+	}
+	spin_unlock_irqrestore(&dev->plug_lock, flags);
+
+	return taken;
+}
+
+static void relay_plug_end(struct relay_io *rio, blk_status_t status)
+{
+	struct relay_plug *plug = rio->private;
+	struct relay_dev *dev = rio->dev;
+	struct bio *bio;
+
+	if (dev->cache_budget)
+		relay_cache_invalidate(dev, plug->start, plug->end);
+
+	while ((bio = bio_list_pop(&plug->bios))) {
+		bio->bi_status = status;
+		bio_endio(bio);
+	}
+	kfree(plug);
+}
+
+/* Write a closed plug as one bio; its pages go back to the pool after */
+static void relay_plug_submit(struct relay_dev *dev, struct relay_plug *plug)
+{
+	unsigned int size = (plug->end - plug->start) << SECTOR_SHIFT;
+	struct relay_io *rio;
+	struct bio *bio;
+	unsigned int i, len;
+
+	bio = bio_alloc_bioset(GFP_NOIO, plug->nr_pages, &dev->io_bio_set);
+	rio = container_of(bio, struct relay_io, bio);
+	rio->dev = dev;
+	bio->bi_iter.bi_sector = plug->start;
+	bio->bi_opf = REQ_OP_WRITE;
+	for (i = 0; i < plug->nr_pages; i++) {
+		len = min_t(unsigned int, size, PAGE_SIZE);
+		bio_add_page(bio, plug->pages[i], len, 0);
+		size -= len;
+	}
+
+	relay_io_submit(rio, relay_plug_end, plug);
+}
+
+static void relay_plug_work(struct work_struct *work)
+{
+	struct relay_dev *dev = container_of(work, struct relay_dev,
+			plug_work);
+	struct relay_plug *plug, *next;
+	struct bio_list after;
+	unsigned int nr;
+	struct bio *bio;
+	LIST_HEAD(ready);
+
+	for (;;) {
+		spin_lock_irq(&dev->plug_lock);
+		list_splice_init(&dev->plug_ready, &ready);
+		after = dev->plug_after;
+		bio_list_init(&dev->plug_after);
+		dev->plug_busy = !list_empty(&ready) || !bio_list_empty(&after);
+		spin_unlock_irq(&dev->plug_lock);
+		if (list_empty(&ready) && bio_list_empty(&after))
+			break;
+
+		nr = 0;
+		list_for_each_entry_safe(plug, next, &ready, list) {
+			list_del(&plug->list);
+			relay_plug_submit(dev, plug);
+			nr++;
+		}
+		while ((bio = bio_list_pop(&after)))
+			relay_clone_submit(dev, bio, 0);
+
+		spin_lock_irq(&dev->plug_lock);
+		dev->coalesced_writes += nr;
+		spin_unlock_irq(&dev->plug_lock);
+	}
+}
+
+static void relay_plug_init(struct relay_dev *dev)
+{
+	spin_lock_init(&dev->plug_lock);
+	INIT_LIST_HEAD(&dev->plug_ready);
+	bio_list_init(&dev->plug_after);
+	INIT_WORK(&dev->plug_work, relay_plug_work);
+	hrtimer_init(&dev->plug_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->plug_timer.function = relay_plug_timer;
+	if (coalesce_us)
+		dev->plug_max = clamp_t(unsigned int, coalesce_kb << 1,
+				RELAY_CBLOCK_SECTORS,
+				RELAY_IO_MAX_PAGES << RELAY_CBLOCK_SHIFT);
+}
+
+/* Submit what is still plugged and wait until it was handed on */
+static void relay_plug_flush(struct relay_dev *dev)
+{
+	hrtimer_cancel(&dev->plug_timer);
+	spin_lock_irq(&dev->plug_lock);
+	relay_plug_dispatch(dev);
+	spin_unlock_irq(&dev->plug_lock);
+	flush_work(&dev->plug_work);
+}
+
+static blk_qc_t relay_forward(struct relay_dev *dev, struct bio *bio)
+{
+	u64 gen = 0;
+
+	/*
+	 * Writes invalidate both when sent and when done, so neither a read
+	 * sent before nor one racing with the write can cache old data.
+	 */
+	if (dev->cache_budget && bio_sectors(bio)) {
+		if (bio_op(bio) == REQ_OP_READ) {
+			if (relay_cache_read(dev, bio, &gen)) {
+				bio_endio(bio);
+				return BLK_QC_T_NONE;
+			}
+		} else if (op_is_write(bio_op(bio))) {
+			relay_cache_invalidate(dev, bio->bi_iter.bi_sector,
+					bio_end_sector(bio));
+		}
+	}
+
+	if (dev->plug_max && relay_plug(dev, bio))
+		return BLK_QC_T_NONE;
+
+	return relay_clone_submit(dev, bio, gen);
+}
+
+/*
+ * Copy between the bio data and buffered blocks, which must all exist.
+ * Writes mark the sectors valid and stamp the blocks with seq.
+ */
+static void relay_wb_copy(struct relay_dev *dev, struct bio *bio,
+		bool to_buffer, u64 seq)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	struct relay_dblock *db;
+	unsigned int len, chunk, boff;
+	sector_t sector;
+	u8 *base, *mem, *dmem;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		sector = iter.bi_sector;
+		len = bvec.bv_len;
+		base = kmap_atomic(bvec.bv_page);
+		mem = base + bvec.bv_offset;
+		while (len) {
+			boff = (sector & (RELAY_CBLOCK_SECTORS - 1)) <<
+				SECTOR_SHIFT;
+			chunk = min_t(unsigned int, len, PAGE_SIZE - boff);
+			db = radix_tree_lookup(&dev->dirty,
+					sector >> RELAY_CBLOCK_SHIFT);
+			dmem = kmap_atomic(db->page);
+			if (to_buffer) {
+				memcpy(dmem + boff, mem, chunk);
+				bitmap_set(db->valid, boff >> SECTOR_SHIFT,
+						chunk >> SECTOR_SHIFT);
+				db->seq = seq;
+				if (!db->first_seq)
+					db->first_seq = seq;
+			} else {
+				memcpy(mem, dmem + boff, chunk);
+			}
+			kunmap_atomic(dmem);
+			sector += chunk >> SECTOR_SHIFT;
+			mem += chunk;
+			len -= chunk;
+		}
+		kunmap_atomic(base);
+	}
+}
+
+/*
+ * Buffer a write and let the caller acknowledge it. Writers wait while
+ * the buffer is over dirty_ratio.
+ */
+static int relay_wb_write(struct relay_dev *dev, struct bio *bio)
+{
+	sector_t sector = bio->bi_iter.bi_sector;
+	pgoff_t first = sector >> RELAY_CBLOCK_SHIFT;
+	pgoff_t last = (bio_end_sector(bio) - 1) >> RELAY_CBLOCK_SHIFT;
+	struct relay_dblock *db;
+	struct page *page = NULL;
+	pgoff_t idx;
+
+	if (READ_ONCE(dev->nr_dirty) >= dev->wb_limit) {
+		WRITE_ONCE(dev->wb_kick, true);
+		wake_up(&dev->flusher_wait);
+		wait_event(dev->wb_wait,
+				READ_ONCE(dev->nr_dirty) < dev->wb_limit);
+	}
+
+again:
+	/* allocate the missing blocks, the copy cannot sleep */
+	for (idx = first; idx <= last; idx++) {
+		spin_lock_irq(&dev->wb_lock);
+		db = radix_tree_lookup(&dev->dirty, idx);
+		spin_unlock_irq(&dev->wb_lock);
+		if (db)
+			continue;
+
+		db = kzalloc(sizeof(*db), GFP_NOIO);
+		page = alloc_page(GFP_NOIO);
+		if (!db || !page)
+			goto out_nomem;
+		db->index = idx;
+		db->page = page;
+
+		if (radix_tree_preload(GFP_NOIO))
+			goto out_nomem;
+		spin_lock_irq(&dev->wb_lock);
+		if (radix_tree_insert(&dev->dirty, idx, db)) {
+			__free_page(page);
+			kfree(db);
+		} else {
+			dev->nr_dirty++;
+		}
+		spin_unlock_irq(&dev->wb_lock);
+		radix_tree_preload_end();
+	}
+
+	spin_lock_irq(&dev->wb_lock);
+	/* blocks written back meanwhile are gone again */
+	for (idx = first; idx <= last; idx++) {
+		if (!radix_tree_lookup(&dev->dirty, idx)) {
+			spin_unlock_irq(&dev->wb_lock);
+			goto again;
+		}
+	}
+	relay_wb_copy(dev, bio, true, ++dev->wb_seq);
+	if (dev->nr_dirty >= dev->wb_background && !dev->wb_kick) {
+		dev->wb_kick = true;
+		wake_up(&dev->flusher_wait);
+	}
+	spin_unlock_irq(&dev->wb_lock);
+
+	return 0;
+
+out_nomem:
+	if (page)
+		__free_page(page);
+	kfree(db);
+	return -ENOMEM;
+}
+
+/*
+ * Serve a read from the buffer if it holds every sector. Returns 1 if
+ * served, 0 if no buffered data overlaps and -EAGAIN for a partial
+ * overlap, which needs a write-back before the target can be read.
+ */
+static int relay_wb_read(struct relay_dev *dev, struct bio *bio)
+{
+	sector_t sector = bio->bi_iter.bi_sector;
+	sector_t end = bio_end_sector(bio);
+	unsigned int s, e;
+	struct relay_dblock *db;
+	bool any = false, full = true;
+	pgoff_t idx;
+
+	spin_lock_irq(&dev->wb_lock);
+	for (idx = sector >> RELAY_CBLOCK_SHIFT;
+			idx <= (end - 1) >> RELAY_CBLOCK_SHIFT; idx++) {
+		db = radix_tree_lookup(&dev->dirty, idx);
+		if (!db) {
+			full = false;
+			continue;
+		}
+		s = max_t(sector_t, sector, (sector_t)idx <<
+				RELAY_CBLOCK_SHIFT) & (RELAY_CBLOCK_SECTORS - 1);
+		e = min_t(sector_t, end - ((sector_t)idx << RELAY_CBLOCK_SHIFT),
+				RELAY_CBLOCK_SECTORS);
+		if (find_next_bit(db->valid, e, s) < e)
+			any = true;
+		if (find_next_zero_bit(db->valid, e, s) < e)
+			full = false;
+	}
+
+	if (any && full)
+		relay_wb_copy(dev, bio, false, 0);
+	spin_unlock_irq(&dev->wb_lock);
+
+	if (!any)
+		return 0;
+	return full ? 1 : -EAGAIN;
+}
+
+static void relay_wb_end(struct relay_io *rio, blk_status_t status)
+{
+	struct relay_wb_io *wio = rio->private;
+	struct relay_dev *dev = rio->dev;
+	struct relay_dblock *db;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&dev->wb_lock, flags);
+	for (i = 0; i < wio->nr; i++) {
+		db = wio->blocks[i];
+		/* a partial block goes out as several runs, any may fail */
+		if (status)
+			db->wb_error = blk_status_to_errno(status);
+		if (--db->wb_pending)
+			continue;
+		/* a failed block stays dirty and is retried by the next pass */
+		if (db->wb_error)
+			continue;
+		if (db->seq == wio->seqs[i]) {
+			radix_tree_delete(&dev->dirty, db->index);
+			dev->nr_dirty--;
+			__free_page(db->page);
+			kfree(db);
+		} else {
+			/* rewritten meanwhile, only the newer data is dirty */
+			db->first_seq = wio->seqs[i] + 1;
+		}
+	}
+	dev->wb_done++;
+	wake_up_all(&dev->wb_wait);
+	spin_unlock_irqrestore(&dev->wb_lock, flags);
+
+	kfree(wio);
+}
+
+/* write back a run of adjacent, fully written blocks as one bio */
+static void relay_wb_issue_run(struct relay_dev *dev,
+		struct relay_dblock **run, unsigned int nr)
+{
+	struct relay_wb_io *wio;
+	struct relay_io *rio;
+	unsigned int i;
+
+	wio = kmalloc(sizeof(*wio), GFP_NOIO | __GFP_NOFAIL);
+	rio = relay_io_alloc(dev, REQ_OP_WRITE,
+			(sector_t)run[0]->index << RELAY_CBLOCK_SHIFT,
+			nr << PAGE_SHIFT);
+
+	spin_lock_irq(&dev->wb_lock);
+	wio->nr = nr;
+	for (i = 0; i < nr; i++) {
+		copy_highpage(rio->bio.bi_io_vec[i].bv_page, run[i]->page);
+		wio->blocks[i] = run[i];
+		wio->seqs[i] = run[i]->seq;
+	}
+	spin_unlock_irq(&dev->wb_lock);
+
+	relay_io_submit(rio, relay_wb_end, wio);
+}
+
+/* write back each run of valid sectors of a partially written block */
+static void relay_wb_issue_partial(struct relay_dev *dev,
+		struct relay_dblock *db)
+{
+	DECLARE_BITMAP(valid, RELAY_CBLOCK_SECTORS);
+	unsigned int rs, re, nr_runs = 0;
+	struct relay_wb_io *wio;
+	struct relay_io *rio;
+	u8 *snap, *mem;
+	u64 seq;
+
+	snap = kmalloc(PAGE_SIZE, GFP_NOIO | __GFP_NOFAIL);
+
+	/* snapshot the block, writers may keep changing it */
+	spin_lock_irq(&dev->wb_lock);
+	mem = kmap_atomic(db->page);
+	memcpy(snap, mem, PAGE_SIZE);
+	kunmap_atomic(mem);
+	bitmap_copy(valid, db->valid, RELAY_CBLOCK_SECTORS);
+	seq = db->seq;
+	for (rs = find_first_bit(valid, RELAY_CBLOCK_SECTORS);
+			rs < RELAY_CBLOCK_SECTORS;
+			rs = find_next_bit(valid, RELAY_CBLOCK_SECTORS, re)) {
+		re = find_next_zero_bit(valid, RELAY_CBLOCK_SECTORS, rs);
+		nr_runs++;
+	}
+	/* the caller counted this block once already */
+	db->wb_pending += nr_runs - 1;
+	spin_unlock_irq(&dev->wb_lock);
+
+	for (rs = find_first_bit(valid, RELAY_CBLOCK_SECTORS);
+			rs < RELAY_CBLOCK_SECTORS;
+			rs = find_next_bit(valid, RELAY_CBLOCK_SECTORS, re)) {
+		re = find_next_zero_bit(valid, RELAY_CBLOCK_SECTORS, rs);
+
+		wio = kmalloc(sizeof(*wio), GFP_NOIO | __GFP_NOFAIL);
+		wio->nr = 1;
+		wio->blocks[0] = db;
+		wio->seqs[0] = seq;
+
+		rio = relay_io_alloc(dev, REQ_OP_WRITE,
+				((sector_t)db->index << RELAY_CBLOCK_SHIFT) + rs,
+				(re - rs) << SECTOR_SHIFT);
+		mem = kmap_atomic(rio->bio.bi_io_vec[0].bv_page);
+		memcpy(mem, snap + (rs << SECTOR_SHIFT),
+				(re - rs) << SECTOR_SHIFT);
+		kunmap_atomic(mem);
+		relay_io_submit(rio, relay_wb_end, wio);
+	}
+
+	kfree(snap);
+}
+
+/*
+ * Write back the blocks in [idx, last] whose oldest write is at most
+ * max_seq, in index order, merging adjacent full blocks up to the engine
+ * I/O size. Returns true if any such block is being written back. A flush
+ * passes its number and tries each block once: a block whose write-back
+ * it started and saw fail is left alone and its error put in *err.
+ */
+static bool relay_wb_pass(struct relay_dev *dev, pgoff_t idx, pgoff_t last,
+		u64 max_seq, u64 flush, int *err)
+{
+	struct relay_dblock *batch[RELAY_IO_MAX_PAGES];
+	struct relay_dblock *run[RELAY_IO_MAX_PAGES];
+	unsigned int nr, n, i, j;
+	bool found = false;
+
+	while (idx <= last) {
+		spin_lock_irq(&dev->wb_lock);
+		nr = radix_tree_gang_lookup(&dev->dirty, (void **)batch, idx,
+				ARRAY_SIZE(batch));
+		if (!nr) {
+			spin_unlock_irq(&dev->wb_lock);
+			break;
+		}
+		idx = batch[nr - 1]->index + 1;
+		n = 0;
+		for (i = 0; i < nr && batch[i]->index <= last; i++) {
+			struct relay_dblock *db = batch[i];
+
+			/* left empty by a writer that failed to allocate */
+			if (!db->first_seq && !db->wb_pending) {
+				radix_tree_delete(&dev->dirty, db->index);
+				dev->nr_dirty--;
+				__free_page(db->page);
+				kfree(db);
+				continue;
+			}
+			if (db->first_seq > max_seq)
+				continue;
+			/* one write-back at a time keeps them in order */
+			if (db->wb_pending) {
+				found = true;
+				continue;
+			}
+			if (flush && db->wb_flush == flush && db->wb_error) {
+				*err = db->wb_error;
+				continue;
+			}
+			db->wb_pending = 1;
+			db->wb_error = 0;
+			db->wb_flush = flush;
+			run[n++] = db;
+			found = true;
+		}
+		spin_unlock_irq(&dev->wb_lock);
+
+		/* valid bits only grow, a full block stays full */
+		for (i = 0; i < n; i = j) {
+			j = i + 1;
+			if (!bitmap_full(run[i]->valid, RELAY_CBLOCK_SECTORS)) {
+				relay_wb_issue_partial(dev, run[i]);
+				continue;
+			}
+			while (j < n && run[j]->index == run[j - 1]->index + 1 &&
+					bitmap_full(run[j]->valid,
+						RELAY_CBLOCK_SECTORS))
+				j++;
+			relay_wb_issue_run(dev, run + i, j - i);
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Make every write to [start, end) acknowledged so far durable on the
+ * target. Each block gets one more write-back; returns the error of one
+ * that failed, blocks outside the range do not matter. Only called from
+ * the flusher and teardown: the engine bios must not sit on a
+ * make_request bio list.
+ */
+static int relay_wb_flush(struct relay_dev *dev, sector_t start,
+		sector_t end)
+{
+	pgoff_t first = start >> RELAY_CBLOCK_SHIFT;
+	pgoff_t last = (end - 1) >> RELAY_CBLOCK_SHIFT;
+	u64 max_seq, flush, done;
+	int err = 0;
+
+	spin_lock_irq(&dev->wb_lock);
+	max_seq = dev->wb_seq;
+	flush = ++dev->wb_flushes;
+	spin_unlock_irq(&dev->wb_lock);
+
+	while (1) {
+		done = READ_ONCE(dev->wb_done);
+		if (!relay_wb_pass(dev, first, last, max_seq, flush, &err))
+			break;
+		wait_event(dev->wb_wait, READ_ONCE(dev->wb_done) != done);
+	}
+
+	return err;
+}
+
+/* Copy the valid buffered sectors over the bio data; wb_lock held */
+static void relay_wb_overlay(struct relay_dev *dev, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	struct relay_dblock *db;
+	unsigned int off, s;
+	sector_t sector;
+	u8 *base, *dmem;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		sector = iter.bi_sector;
+		base = kmap_atomic(bvec.bv_page);
+		for (off = 0; off < bvec.bv_len; off += SECTOR_SIZE, sector++) {
+			db = radix_tree_lookup(&dev->dirty,
+					sector >> RELAY_CBLOCK_SHIFT);
+			s = sector & (RELAY_CBLOCK_SECTORS - 1);
+			if (!db || !test_bit(s, db->valid))
+				continue;
+			dmem = kmap_atomic(db->page);
+			memcpy(base + bvec.bv_offset + off,
+					dmem + (s << SECTOR_SHIFT),
+					SECTOR_SIZE);
+			kunmap_atomic(dmem);
+		}
+		kunmap_atomic(base);
+	}
+}
+
+static void relay_wb_read_end(struct bio *clone)
+{
+	complete(clone->bi_private);
+}
+
+/*
+ * Serve a read over buffered data that could not be written back: read
+ * the target and lay the buffered sectors over it. Waits for the read so
+ * no write-back retires a block in between.
+ */
+static void relay_wb_read_through(struct relay_dev *dev, struct bio *bio)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *clone;
+
+	clone = bio_clone_fast(bio, GFP_NOIO, &dev->bio_set);
+	if (!clone) {
+		bio_io_error(bio);
+		return;
+	}
+	clone->bi_private = &done;
+	clone->bi_end_io = relay_wb_read_end;
+	relay_submit(dev, clone);
+	wait_for_completion_io(&done);
+
+	bio->bi_status = clone->bi_status;
+	bio_put(clone);
+	if (!bio->bi_status) {
+		spin_lock_irq(&dev->wb_lock);
+		relay_wb_overlay(dev, bio);
+		spin_unlock_irq(&dev->wb_lock);
+	}
+	bio_endio(bio);
+}
+
+/*
+ * Flush what a deferred bio depends on, then forward it. Writes fail if
+ * that write-back does; reads go around it instead.
+ */
+static void relay_wb_run_deferred(struct relay_dev *dev)
+{
+	struct bio *bio;
+	int err;
+
+	while (1) {
+		spin_lock_irq(&dev->wb_lock);
+		bio = bio_list_pop(&dev->wb_deferred);
+		spin_unlock_irq(&dev->wb_lock);
+		if (!bio)
+			break;
+
+		if (bio->bi_opf & REQ_PREFLUSH)
+			err = relay_wb_flush(dev, 0, dev->nr_sectors);
+		else
+			err = relay_wb_flush(dev, bio->bi_iter.bi_sector,
+					bio_end_sector(bio));
+		if (err && bio_op(bio) == REQ_OP_READ) {
+			relay_wb_read_through(dev, bio);
+			continue;
+		}
+		if (err) {
+			bio->bi_status = errno_to_blk_status(err);
+			bio_endio(bio);
+			continue;
+		}
+		relay_forward(dev, bio);
+	}
+}
+
+static int relay_flusher(void *data)
+{
+	struct relay_dev *dev = data;
+	u64 done;
+
+	while (!kthread_should_stop()) {
+		relay_wb_run_deferred(dev);
+
+		/* everything dirty when the pass starts, sorted by sector */
+		done = READ_ONCE(dev->wb_done);
+		relay_wb_pass(dev, 0, (dev->nr_sectors - 1) >>
+				RELAY_CBLOCK_SHIFT, READ_ONCE(dev->wb_seq),
+				0, NULL);
+
+		/* still over the threshold: let some write-back finish */
+		if (READ_ONCE(dev->nr_dirty) >= dev->wb_background)
+			wait_event_timeout(dev->wb_wait,
+					READ_ONCE(dev->wb_done) != done ||
+					kthread_should_stop(), HZ / 100);
+
+		wait_event_timeout(dev->flusher_wait, kthread_should_stop() ||
+				READ_ONCE(dev->wb_kick) ||
+				!bio_list_empty(&dev->wb_deferred),
+				msecs_to_jiffies(wb_expire_ms));
+		WRITE_ONCE(dev->wb_kick, false);
+	}
+
+	return 0;
+}
+
+/* Forget the sectors of db in [start, end); wb_lock held, db idle */
+static void relay_wb_trim(struct relay_dev *dev, struct relay_dblock *db,
+		sector_t start, sector_t end)
+{
+	sector_t base = (sector_t)db->index << RELAY_CBLOCK_SHIFT;
+	unsigned int s, e;
+
+	s = max(start, base) - base;
+	e = min_t(sector_t, end - base, RELAY_CBLOCK_SECTORS);
+	bitmap_clear(db->valid, s, e - s);
+	if (!bitmap_empty(db->valid, RELAY_CBLOCK_SECTORS))
+		return;
+
+	radix_tree_delete(&dev->dirty, db->index);
+	dev->nr_dirty--;
+	__free_page(db->page);
+	kfree(db);
+}
+
+/*
+ * Drop the buffered data a discard or write-zeroes replaces, so it can go
+ * to the target right away. Returns -EAGAIN if a block in the range is
+ * being written back: that older data could land after the bio, so the
+ * bio waits for the write-back in the flusher instead.
+ */
+static int relay_wb_drop(struct relay_dev *dev, struct bio *bio)
+{
+	sector_t start = bio->bi_iter.bi_sector;
+	sector_t end = bio_end_sector(bio);
+	pgoff_t last = (end - 1) >> RELAY_CBLOCK_SHIFT;
+	struct relay_dblock *batch[16];
+	unsigned int nr, i;
+	pgoff_t idx;
+	int pass;
+
+	spin_lock_irq(&dev->wb_lock);
+	/* nothing is dropped unless the whole range is idle */
+	for (pass = 0; pass < 2; pass++) {
+		idx = start >> RELAY_CBLOCK_SHIFT;
+		while (idx <= last && (nr = radix_tree_gang_lookup(&dev->dirty,
+				(void **)batch, idx, ARRAY_SIZE(batch)))) {
+			idx = batch[nr - 1]->index + 1;
+			for (i = 0; i < nr && batch[i]->index <= last; i++) {
+				if (pass)
+					relay_wb_trim(dev, batch[i], start, end);
+				else if (batch[i]->wb_pending)
+					goto out_busy;
+			}
+		}
+	}
+	wake_up_all(&dev->wb_wait);
+	spin_unlock_irq(&dev->wb_lock);
+
+	return 0;
+
+out_busy:
+	spin_unlock_irq(&dev->wb_lock);
+	return -EAGAIN;
+}
+
+static void relay_wb_defer(struct relay_dev *dev, struct bio *bio)
+{
+	spin_lock_irq(&dev->wb_lock);
+	bio_list_add(&dev->wb_deferred, bio);
+	spin_unlock_irq(&dev->wb_lock);
+	wake_up(&dev->flusher_wait);
+}
+
+/*
+ * Write-back mode: plain writes are buffered and acknowledged, reads of
+ * buffered data are served from the buffer. Discards and write-zeroes
+ * drop the buffered data they replace and go to the target. PREFLUSH,
+ * FUA and reads partly over buffered data go to the target once what
+ * they depend on is written back, which the flusher does for them.
+ * Returns false for bios to forward right away.
+ */
+static bool relay_wb_make_request(struct relay_dev *dev, struct bio *bio)
+{
+	int ret;
+
+	if (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)) {
+		relay_wb_defer(dev, bio);
+		return true;
+	}
+
+	switch (bio_op(bio)) {
+	case REQ_OP_WRITE:
+		if (dev->cache_budget)
+			relay_cache_invalidate(dev, bio->bi_iter.bi_sector,
+					bio_end_sector(bio));
+		ret = relay_wb_write(dev, bio);
+		/* readahead sampling the generation meanwhile now sees it */
+		if (dev->cache_budget)
+			relay_cache_invalidate(dev, bio->bi_iter.bi_sector,
+					bio_end_sector(bio));
+		bio->bi_status = errno_to_blk_status(ret);
+		bio_endio(bio);
+		return true;
+	case REQ_OP_READ:
+		ret = relay_wb_read(dev, bio);
+		if (ret > 0) {
+			bio_endio(bio);
+			return true;
+		}
+		break;
+	default:
+		ret = bio_sectors(bio) ? relay_wb_drop(dev, bio) : 0;
+		break;
+	}
+
+	if (ret == -EAGAIN) {
+		relay_wb_defer(dev, bio);
+		return true;
+	}
+	return false;
+}
+
+/* true if any of nr blocks from idx has buffered data */
+static bool relay_wb_overlaps(struct relay_dev *dev, pgoff_t idx,
+		unsigned int nr)
+{
+	struct relay_dblock *db;
+	bool ret;
+
+	spin_lock_irq(&dev->wb_lock);
+	ret = radix_tree_gang_lookup(&dev->dirty, (void **)&db, idx, 1) &&
+		db->index < idx + nr;
+	spin_unlock_irq(&dev->wb_lock);
+
+	return ret;
+}
+
+static void relay_ra_end(struct relay_io *rio, blk_status_t status)
+{
+	if (!status)
+		relay_cache_fill(rio->dev, &rio->bio, rio->cache_gen);
+}
+
+/*
+ * Read nr blocks from idx into the cache, unless they are cached already
+ * or the write-back buffer holds newer data for some of them.
+ */
+static void relay_ra_issue(struct relay_dev *dev, pgoff_t idx,
+		unsigned int nr)
+{
+	sector_t sector = (sector_t)idx << RELAY_CBLOCK_SHIFT;
+	struct relay_cblock *cb;
+	struct relay_io *rio;
+	unsigned int i;
+	u64 gen;
+
+	/* sampled first, so writes buffered after the check below bump it */
+	spin_lock_irq(&dev->cache_lock);
+	gen = relay_cache_gen(dev, sector,
+			sector + ((sector_t)nr << RELAY_CBLOCK_SHIFT));
+	for (i = 0; i < nr; i++) {
+		cb = radix_tree_lookup(&dev->cache, idx + i);
+		if (!cb || !cb->page)
+			break;
+	}
+	spin_unlock_irq(&dev->cache_lock);
+	if (i == nr)
+		return;
+
+	if (dev->flusher && relay_wb_overlaps(dev, idx, nr))
+		return;
+
+	rio = relay_io_alloc(dev, REQ_OP_READ, sector, nr << PAGE_SHIFT);
+	rio->cache_gen = gen;
+	relay_io_submit(rio, relay_ra_end, NULL);
+
+	spin_lock_irq(&dev->ra_lock);
+	dev->ra_blocks += nr;
+	spin_unlock_irq(&dev->ra_lock);
+}
+
+/* Issue the readahead requested by the streams, from process context */
+static void relay_ra_work(struct work_struct *work)
+{
+	struct relay_dev *dev = container_of(work, struct relay_dev, ra_work);
+	struct relay_stream *st;
+	unsigned int i, nr;
+	pgoff_t idx = 0;
+
+	for (;;) {
+		nr = 0;
+		spin_lock_irq(&dev->ra_lock);
+		for (i = 0; i < RELAY_RA_STREAMS; i++) {
+			st = &dev->streams[i];
+			if (st->ra_issued >= st->ra_end)
+				continue;
+			idx = st->ra_issued;
+			nr = min_t(pgoff_t, st->ra_end - idx,
+					RELAY_IO_MAX_PAGES);
+			st->ra_issued += nr;
+			break;
+		}
+		spin_unlock_irq(&dev->ra_lock);
+		if (!nr)
+			break;
+		relay_ra_issue(dev, idx, nr);
+	}
+}
+
+/*
+ * Follow the read streams. A read that starts where a stream's last read
+ * ended makes it sequential, and from then on the stream is kept a window
+ * ahead of the reader. The window doubles, up to ra_max, each time the
+ * reader gets within half a window of the readahead, so streams that
+ * keep going get larger and fewer prefetch I/Os. Any other read starts a
+ * new stream in place of the one idle longest.
+ */
+static void relay_ra_account(struct relay_dev *dev, struct bio *bio)
+{
+	sector_t sector = bio->bi_iter.bi_sector;
+	sector_t end = bio_end_sector(bio);
+	pgoff_t next = DIV_ROUND_UP_SECTOR_T(end, RELAY_CBLOCK_SECTORS);
+	pgoff_t limit = dev->nr_sectors >> RELAY_CBLOCK_SHIFT;
+	struct relay_stream *st, *lru = NULL;
+	unsigned long flags;
+	bool kick = false;
+	unsigned int i;
+
+	spin_lock_irqsave(&dev->ra_lock, flags);
+	for (i = 0; i < RELAY_RA_STREAMS; i++) {
+		st = &dev->streams[i];
+		if (st->next == sector)
+			goto sequential;
+		if (!lru || st->stamp < lru->stamp)
+			lru = st;
+	}
+
+	lru->next = end;
+	lru->ra_end = lru->ra_issued = next;
+	lru->window = 0;
+	lru->stamp = ++dev->ra_clock;
+	spin_unlock_irqrestore(&dev->ra_lock, flags);
+	return;
+
+sequential:
+	st->next = end;
+	st->stamp = ++dev->ra_clock;
+	/* the reader overtook the readahead, restart it at the reader */
+	if (st->ra_end < next)
+		st->ra_end = next;
+	if (st->ra_issued < next)
+		st->ra_issued = next;
+
+	if (!st->window) {
+		st->window = clamp_t(unsigned int,
+				2 * (bio_sectors(bio) >> RELAY_CBLOCK_SHIFT),
+				RELAY_RA_MIN, dev->ra_max);
+		st->ra_end = next + st->window;
+		kick = true;
+	} else if (st->ra_end - next < st->window / 2) {
+		st->window = min(st->window * 2, dev->ra_max);
+		st->ra_end += st->window;
+		kick = true;
+	}
+	if (st->ra_end > limit)
+		st->ra_end = limit;
+	spin_unlock_irqrestore(&dev->ra_lock, flags);
+
+	if (kick)
+		queue_work(relay_wq, &dev->ra_work);
+}
+
+static void relay_ra_init(struct relay_dev *dev)
+{
+	int i;
+
+	spin_lock_init(&dev->ra_lock);
+	for (i = 0; i < RELAY_RA_STREAMS; i++)
+		dev->streams[i].next = (sector_t)-1;
+	INIT_WORK(&dev->ra_work, relay_ra_work);
+	if (readahead_kb)
+		dev->ra_max = max(readahead_kb >> (PAGE_SHIFT - 10),
+				(unsigned int)RELAY_RA_MIN);
+}
+
+static blk_qc_t relay_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct relay_dev *dev = q->queuedata;
+
+	/* requests to the server are bounded, with no lower queue to split */
+	if (dev->layout == RELAY_NET)
+		blk_queue_split(q, &bio);
+
+	/* reads served by the buffer or the cache move streams as well */
+	if (dev->ra_max && bio_op(bio) == REQ_OP_READ && bio_sectors(bio))
+		relay_ra_account(dev, bio);
+
+	if (dev->flusher && relay_wb_make_request(dev, bio))
+		return BLK_QC_T_NONE;
+
+	return relay_forward(dev, bio);
+}
+
+/* /sys/block/relayN/relay/ describes the mapping and the cache */
+static ssize_t target_show(struct device *d, struct device_attribute *attr,
+		char *buf)
+{
+	struct relay_dev *dev = dev_to_disk(d)->private_data;
+	ssize_t len = 0;
+	unsigned int i;
+
+	if (dev->layout == RELAY_NET)
+		return sprintf(buf, "%pISpc\n", &dev->net_addr);
+
+	for (i = 0; i < dev->nr_members; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%s",
+				i ? " " : "", dev->members[i].path);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+static DEVICE_ATTR_RO(target);
+
+static const char * const relay_layouts[] = {
+	[RELAY_LINEAR]	= "linear",
+	[RELAY_STRIPE]	= "stripe",
+	[RELAY_MIRROR]	= "mirror",
+	[RELAY_NET]	= "net",
+};
+
+static ssize_t layout_show(struct device *d, struct device_attribute *attr,
+		char *buf)
+{
+	struct relay_dev *dev = dev_to_disk(d)->private_data;
+
+	if (dev->layout == RELAY_STRIPE)
+		return sprintf(buf, "%s %u\n", relay_layouts[dev->layout],
+				dev->chunk_sectors >> 1);
+	return sprintf(buf, "%s\n", relay_layouts[dev->layout]);
+}
+static DEVICE_ATTR_RO(layout);
+
+/*
+ * One line per member: path, state, I/Os in flight, then the count and
+ * mean latency in microseconds of finished I/Os. Only mirrors keep the
+ * counters.
+ */
+static ssize_t members_show(struct device *d, struct device_attribute *attr,
+		char *buf)
+{
+	struct relay_dev *dev = dev_to_disk(d)->private_data;
+	struct relay_member *m;
+	ssize_t len = 0;
+	u64 ios, lat_ns;
+	unsigned int i;
+
+	for (i = 0; i < dev->nr_members; i++) {
+		m = &dev->members[i];
+		ios = atomic64_read(&m->ios);
+		lat_ns = atomic64_read(&m->lat_ns);
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"%s %s %d %llu %llu\n", m->path,
+				test_bit(RELAY_MEMBER_FAILED, &m->flags) ?
+				"failed" : "ok", atomic_read(&m->inflight),
+				ios, ios ? div64_u64(lat_ns, ios) / 1000 : 0);
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(members);
+
+static ssize_t offset_show(struct device *d, struct device_attribute *attr,
+		char *buf)
+{
+	struct relay_dev *dev = dev_to_disk(d)->private_data;
+
+	return sprintf(buf, "%llu\n", (unsigned long long)dev->offset);
+}
+static DEVICE_ATTR_RO(offset);
+
+/* u64 counters; a cache hit is a bio served without the target */
+#define RELAY_CACHE_ATTR(_name)						\
+static ssize_t _name##_show(struct device *d,				\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct relay_dev *dev = dev_to_disk(d)->private_data;		\
+									\
+	return sprintf(buf, "%llu\n", (unsigned long long)dev->_name);	\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+RELAY_CACHE_ATTR(cache_hits);
+RELAY_CACHE_ATTR(cache_misses);
+RELAY_CACHE_ATTR(cache_evictions);
+RELAY_CACHE_ATTR(ra_blocks);
+RELAY_CACHE_ATTR(coalesced_bios);
+RELAY_CACHE_ATTR(coalesced_writes);
+
+static ssize_t cache_blocks_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct relay_dev *dev = dev_to_disk(d)->private_data;
+
+	return sprintf(buf, "%lu %lu %lu\n", dev->cache_len[RELAY_A1IN],
+			dev->cache_len[RELAY_AM], dev->cache_len[RELAY_A1OUT]);
+}
+static DEVICE_ATTR_RO(cache_blocks);
+
+static ssize_t dirty_blocks_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct relay_dev *dev = dev_to_disk(d)->private_data;
+
+	return sprintf(buf, "%lu\n", dev->nr_dirty);
+}
+static DEVICE_ATTR_RO(dirty_blocks);
+
+static struct attribute *relay_disk_attrs[] = {
+	&dev_attr_target.attr,
+	&dev_attr_layout.attr,
+	&dev_attr_members.attr,
+	&dev_attr_offset.attr,
+	&dev_attr_cache_hits.attr,
+	&dev_attr_cache_misses.attr,
+	&dev_attr_cache_evictions.attr,
+	&dev_attr_ra_blocks.attr,
+	&dev_attr_coalesced_bios.attr,
+	&dev_attr_coalesced_writes.attr,
+	&dev_attr_cache_blocks.attr,
+	&dev_attr_dirty_blocks.attr,
+	NULL
+};
+
+static const struct attribute_group relay_disk_group = {
+	.name = "relay",
+	.attrs = relay_disk_attrs,
+};
+
+static void close_members(struct relay_dev *dev, unsigned int nr)
+{
+	while (nr--)
+		close_disk(dev->members[nr].bdev);
+}
+
+static void relay_put_targets(struct relay_dev *dev)
+{
+	if (dev->layout == RELAY_NET)
+		relay_net_close(dev);
+	else
+		close_members(dev, dev->nr_members);
+}
+
+/*
+ * A linear relay exposes nr_sectors of its target starting at offset, or
+ * everything past offset when nr_sectors is 0. A striped one spans whole
+ * chunks of all members, up to the smallest of them, and a mirror is as
+ * large as its smallest member.
+ */
+static int relay_set_size(struct relay_dev *dev)
+{
+	struct block_device *bdev = dev->members[0].bdev;
+	sector_t size, member_size, mask;
+	unsigned int i;
+
+	size = i_size_read(bdev->bd_inode) >> SECTOR_SHIFT;
+
+	if (dev->layout != RELAY_LINEAR) {
+		for (i = 0; i < dev->nr_members; i++) {
+			bdev = dev->members[i].bdev;
+			if (dev->layout == RELAY_STRIPE && dev->chunk_sectors &
+					((bdev_logical_block_size(bdev) >>
+					  SECTOR_SHIFT) - 1)) {
+				printk(KERN_ERR "chunk of %u sectors does not "
+						"fit blocks of %s\n",
+						dev->chunk_sectors,
+						dev->members[i].path);
+				return -EINVAL;
+			}
+			size = min_t(sector_t, size,
+					i_size_read(bdev->bd_inode) >>
+					SECTOR_SHIFT);
+		}
+		if (dev->layout == RELAY_MIRROR) {
+			dev->nr_sectors = size;
+			return size ? 0 : -EINVAL;
+		}
+		member_size = size;
+		sector_div(member_size, dev->chunk_sectors);
+		dev->nr_sectors = member_size * dev->chunk_sectors *
+			dev->nr_members;
+		if (!dev->nr_sectors) {
+			printk(KERN_ERR "members smaller than a chunk\n");
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	/* both ends of the range must fall on logical block boundaries */
+	mask = (bdev_logical_block_size(bdev) >> SECTOR_SHIFT) - 1;
+	if (!dev->nr_sectors && dev->offset < size)
+		dev->nr_sectors = size - dev->offset;
+	if (!dev->nr_sectors || dev->offset + dev->nr_sectors > size ||
+			dev->offset + dev->nr_sectors < dev->offset ||
+			(dev->offset & mask) || (dev->nr_sectors & mask)) {
+		printk(KERN_ERR "invalid range %llu+%llu of %s\n",
+				(unsigned long long)dev->offset,
+				(unsigned long long)dev->nr_sectors,
+				dev->members[0].path);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int create_relay_dev(struct relay_dev *dev, int index)
+{
+	struct request_queue *lower;
+	bool wc = writeback, fua = writeback, discard = true;
+	unsigned int i;
+	int err;
+
+	/*
+	 * Relays of one module may share a target, each on its own range,
+	 * and a stripe may even use one disk twice. A network relay gets
+	 * its size from the server instead.
+	 */
+	if (dev->layout == RELAY_NET) {
+		err = relay_net_open(dev);
+		if (err)
+			return err;
+	} else {
+		for (i = 0; i < dev->nr_members; i++) {
+			dev->members[i].bdev = open_disk(dev->members[i].path,
+					&relay_devs);
+			if (IS_ERR(dev->members[i].bdev)) {
+				printk(KERN_ERR "[relay_init] No such device "
+						"%s\n", dev->members[i].path);
+				err = PTR_ERR(dev->members[i].bdev);
+				close_members(dev, i);
+				return err;
+			}
+		}
+
+		err = relay_set_size(dev);
+		if (err)
+			goto out_bioset;
+	}
+
+	err = bioset_init(&dev->bio_set, BIO_POOL_SIZE,
+			offsetof(struct relay_clone, clone), 0);
+	if (err) {
+		printk(KERN_ERR "bioset_init: failure\n");
+		goto out_bioset;
+	}
+
+	/* splits happen in make_request, the rescuer keeps them going */
+	err = bioset_init(&dev->split_set, BIO_POOL_SIZE,
+			offsetof(struct relay_mirror_io, clone),
+			BIOSET_NEED_RESCUER);
+	if (err) {
+		printk(KERN_ERR "bioset_init: failure\n");
+		goto out_split_set;
+	}
+
+	spin_lock_init(&dev->retry_lock);
+	bio_list_init(&dev->retry);
+	INIT_WORK(&dev->retry_work, relay_mirror_retry);
+	spin_lock_init(&dev->preflush_lock);
+	bio_list_init(&dev->preflushed);
+	INIT_WORK(&dev->preflush_work, relay_stripe_preflushed);
+	relay_ra_init(dev);
+	relay_plug_init(dev);
+	relay_cache_init(dev);
+	spin_lock_init(&dev->wb_lock);
+	INIT_RADIX_TREE(&dev->dirty, GFP_ATOMIC);
+	init_waitqueue_head(&dev->wb_wait);
+	init_waitqueue_head(&dev->flusher_wait);
+	bio_list_init(&dev->wb_deferred);
+	dev->wb_background = ((unsigned long)wb_mb << (20 - PAGE_SHIFT)) *
+		dirty_background_ratio / 100;
+	dev->wb_limit = max(((unsigned long)wb_mb << (20 - PAGE_SHIFT)) *
+		dirty_ratio / 100, 1UL);
+	mutex_init(&dev->io_alloc_lock);
+	atomic_set(&dev->io_inflight, 0);
+	init_waitqueue_head(&dev->io_wait);
+	spin_lock_init(&dev->io_lock);
+	err = bioset_init(&dev->io_bio_set, BIO_POOL_SIZE,
+			offsetof(struct relay_io, bio), BIOSET_NEED_BVECS);
+	if (err) {
+		printk(KERN_ERR "bioset_init: failure\n");
+		goto out_io_bioset;
+	}
+
+	/* enough reserved pages for the largest I/O to make progress */
+	dev->page_pool = mempool_create_page_pool(RELAY_IO_MAX_PAGES, 0);
+	if (!dev->page_pool) {
+		printk(KERN_ERR "mempool_create_page_pool: out of memory\n");
+		err = -ENOMEM;
+		goto out_page_pool;
+	}
+
+	dev->queue = blk_alloc_queue(GFP_KERNEL);
+	if (!dev->queue) {
+		printk(KERN_ERR "blk_alloc_queue: out of memory\n");
+		err = -ENOMEM;
+		goto out_queue;
+	}
+	blk_queue_make_request(dev->queue, relay_make_request);
+	dev->queue->queuedata = dev;
+
+	/*
+	 * Inherit block sizes, transfer and discard limits of the lower
+	 * disks, with alignments adjusted for the offset. The write-back
+	 * buffer is a volatile cache of its own.
+	 */
+	blk_set_stacking_limits(&dev->queue->limits);
+	dev->nonrot = true;
+	for (i = 0; i < dev->nr_members; i++) {
+		lower = bdev_get_queue(dev->members[i].bdev);
+		if (bdev_stack_limits(&dev->queue->limits,
+					dev->members[i].bdev, dev->offset) < 0)
+			printk(KERN_WARNING "%s: offset %llu is misaligned\n",
+					dev->members[i].path,
+					(unsigned long long)dev->offset);
+		wc |= test_bit(QUEUE_FLAG_WC, &lower->queue_flags);
+		fua |= test_bit(QUEUE_FLAG_FUA, &lower->queue_flags);
+		discard &= blk_queue_discard(lower);
+		dev->nonrot &= blk_queue_nonrot(lower);
+	}
+	/* the server keeps written data in its page cache until a flush */
+	if (dev->layout == RELAY_NET) {
+		wc = fua = true;
+		discard = dev->net_flags & RELAY_NET_HAS_DISCARD;
+		blk_queue_max_hw_sectors(dev->queue,
+				RELAY_NET_MAX_LEN >> SECTOR_SHIFT);
+		blk_queue_max_discard_sectors(dev->queue,
+				discard ? UINT_MAX >> SECTOR_SHIFT : 0);
+		blk_queue_max_write_same_sectors(dev->queue, 0);
+		blk_queue_max_write_zeroes_sectors(dev->queue, 0);
+	}
+	/* full stripes keep every member busy */
+	if (dev->layout == RELAY_STRIPE) {
+		blk_queue_io_min(dev->queue,
+				dev->chunk_sectors << SECTOR_SHIFT);
+		blk_queue_io_opt(dev->queue, (dev->chunk_sectors <<
+					SECTOR_SHIFT) * dev->nr_members);
+	}
+	blk_queue_write_cache(dev->queue, wc, fua);
+	if (discard)
+		blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+	if (dev->nonrot)
+		blk_queue_flag_set(QUEUE_FLAG_NONROT, dev->queue);
+
+	dev->gd = alloc_disk(RELAY_MINORS);
+	if (!dev->gd) {
+		printk(KERN_ERR "alloc_disk: failure\n");
+		err = -ENOMEM;
+		goto out_disk;
+	}
+	dev->gd->major = relay_major;
+	dev->gd->first_minor = index * RELAY_MINORS;
+	dev->gd->fops = &relay_ops;
+	dev->gd->queue = dev->queue;
+	dev->gd->private_data = dev;
+	snprintf(dev->gd->disk_name, DISK_NAME_LEN, RELAY_BLKDEV_NAME "%d",
+			index);
+	set_capacity(dev->gd, dev->nr_sectors);
+
+	if (writeback) {
+		dev->flusher = kthread_run(relay_flusher, dev, "%s-flush",
+				dev->gd->disk_name);
+		if (IS_ERR(dev->flusher)) {
+			err = PTR_ERR(dev->flusher);
+			dev->flusher = NULL;
+			goto out_flusher;
+		}
+	}
+
+	add_disk(dev->gd);
+
+	if (sysfs_create_group(&disk_to_dev(dev->gd)->kobj, &relay_disk_group))
+		printk(KERN_WARNING "%s: no relay attributes\n",
+				dev->gd->disk_name);
+
+	return 0;
+
+out_flusher:
+	put_disk(dev->gd);
+out_disk:
+	blk_cleanup_queue(dev->queue);
+out_queue:
+	mempool_destroy(dev->page_pool);
+out_page_pool:
+	bioset_exit(&dev->io_bio_set);
+out_io_bioset:
+	bioset_exit(&dev->split_set);
+out_split_set:
+	bioset_exit(&dev->bio_set);
+out_bioset:
+	relay_put_targets(dev);
+	return err;
+}
+
+static void delete_relay_dev(struct relay_dev *dev)
+{
+	unsigned int i;
+	int err = 0;
+
+	/* in-flight clones hold queue references until they complete */
+	sysfs_remove_group(&disk_to_dev(dev->gd)->kobj, &relay_disk_group);
+	del_gendisk(dev->gd);
+	put_disk(dev->gd);
+	blk_cleanup_queue(dev->queue);
+	if (dev->flusher) {
+		kthread_stop(dev->flusher);
+		relay_wb_run_deferred(dev);
+		for (i = 0; i < RELAY_WB_TRIES; i++) {
+			err = relay_wb_flush(dev, 0, dev->nr_sectors);
+			if (!err)
+				break;
+			/* give a failing target time to come back */
+			msleep(wb_expire_ms);
+		}
+		if (err)
+			printk(KERN_ERR RELAY_BLKDEV_NAME "%d: dirty data lost\n",
+					dev->index);
+	}
+	/* no reads come in any more, so no new readahead either */
+	flush_work(&dev->ra_work);
+	relay_plug_flush(dev);
+	relay_io_drain(dev);
+	/* the work item may still be returning from a retried read */
+	flush_work(&dev->retry_work);
+	flush_work(&dev->preflush_work);
+	relay_wb_free(dev);
+	relay_cache_free(dev);
+	mempool_destroy(dev->page_pool);
+	bioset_exit(&dev->io_bio_set);
+	bioset_exit(&dev->split_set);
+	bioset_exit(&dev->bio_set);
+	relay_put_targets(dev);
+}
+
+/* Bring up a relay described by dev, which is freed on failure */
+static int relay_add(struct relay_dev *dev)
+{
+	int err;
+
+	dev->index = ida_simple_get(&relay_ida, 0, RELAY_MAX_DEVICES,
+			GFP_KERNEL);
+	if (dev->index < 0) {
+		err = dev->index;
+		goto out_ida;
+	}
+
+	err = create_relay_dev(dev, dev->index);
+	if (err)
+		goto out_create;
+
+	mutex_lock(&relay_lock);
+	list_add_tail(&dev->list, &relay_devs);
+	mutex_unlock(&relay_lock);
+
+	return 0;
+
+out_create:
+	ida_simple_remove(&relay_ida, dev->index);
+out_ida:
+	kfree(dev);
+	return err;
+}
+
+static void relay_free(struct relay_dev *dev)
+{
+	delete_relay_dev(dev);
+	ida_simple_remove(&relay_ida, dev->index);
+	kfree(dev);
+}
+
+static int relay_del(const char *name)
+{
+	struct relay_dev *dev;
+	int err = -ENODEV;
+
+	mutex_lock(&relay_lock);
+	list_for_each_entry(dev, &relay_devs, list) {
+		if (strcmp(dev->gd->disk_name, name))
+			continue;
+		if (dev->open_count) {
+			err = -EBUSY;
+			break;
+		}
+		/* new opens fail from here on */
+		dev->deleting = true;
+		list_del(&dev->list);
+		if (dev == test_dev)
+			test_dev = NULL;
+		err = 0;
+		break;
+	}
+	mutex_unlock(&relay_lock);
+
+	if (!err)
+		relay_free(dev);
+	return err;
+}
+
+static char *next_word(char **args)
+{
+	char *word;
+
+	do {
+		word = strsep(args, " \t\n");
+	} while (word && !*word);
+
+	return word;
+}
+
+static int relay_parse_net(struct relay_dev *dev, char *args)
+{
+	unsigned int conns = RELAY_NET_CONNS;
+	u16 port = RELAY_NET_PORT;
+	const char *end;
+	char *word;
+
+	word = next_word(&args);
+	if (!word || !in4_pton(word, -1,
+				(u8 *)&dev->net_addr.sin_addr.s_addr, ':', &end))
+		return -EINVAL;
+	if (*end == ':' && kstrtou16(end + 1, 0, &port))
+		return -EINVAL;
+
+	word = next_word(&args);
+	if (word && (kstrtouint(word, 0, &conns) || !conns ||
+				conns > RELAY_NET_MAX_CONNS))
+		return -EINVAL;
+	if (next_word(&args))
+		return -EINVAL;
+
+	dev->layout = RELAY_NET;
+	dev->net_addr.sin_family = AF_INET;
+	dev->net_addr.sin_port = htons(port);
+	dev->nr_conns = conns;
+	return 0;
+}
+
+/*
+ * Fill the layout of dev from the words of an add command:
+ *   "<path> [offset [nr_sectors]]"
+ *   "stripe <chunk_kb> <path>..."
+ *   "mirror <path>..."
+ *   "net <ipv4>[:port] [connections]"
+ * Mirror members are not synchronized: they must hold identical data
+ * when the relay is added, e.g. all freshly zeroed or copied from one.
+ */
+static int relay_parse(struct relay_dev *dev, char *args)
+{
+	unsigned long long val;
+	unsigned int chunk_kb;
+	char *word;
+
+	word = next_word(&args);
+	if (!word)
+		return -EINVAL;
+
+	if (!strcmp(word, "stripe")) {
+		word = next_word(&args);
+		if (!word || kstrtouint(word, 0, &chunk_kb) || !chunk_kb ||
+				chunk_kb > UINT_MAX >> 1)
+			return -EINVAL;
+		dev->layout = RELAY_STRIPE;
+		dev->chunk_sectors = chunk_kb << 1;
+	} else if (!strcmp(word, "mirror")) {
+		dev->layout = RELAY_MIRROR;
+	} else if (!strcmp(word, "net")) {
+		return relay_parse_net(dev, args);
+	}
+
+	if (dev->layout != RELAY_LINEAR) {
+		while ((word = next_word(&args))) {
+			if (dev->nr_members == RELAY_MAX_MEMBERS)
+				return -E2BIG;
+			strscpy(dev->members[dev->nr_members++].path, word,
+					RELAY_PATH_LEN);
+		}
+		return dev->nr_members ? 0 : -EINVAL;
+	}
+
+	dev->nr_members = 1;
+	strscpy(dev->members[0].path, word, RELAY_PATH_LEN);
+
+	word = next_word(&args);
+	if (word) {
+		if (kstrtoull(word, 0, &val))
+			return -EINVAL;
+		dev->offset = val;
+		word = next_word(&args);
+	}
+	if (word) {
+		if (kstrtoull(word, 0, &val))
+			return -EINVAL;
+		dev->nr_sectors = val;
+		word = next_word(&args);
+	}
+
+	return word ? -EINVAL : 0;
+}
+
+/* Implement write only add attribute, see relay_parse for the format */
+static ssize_t add_store(struct class *class, struct class_attribute *attr,
+		const char *buf, size_t count)
+{
+	struct relay_dev *dev;
+	char *args;
+	int ret;
+
+	args = kstrndup(buf, count, GFP_KERNEL);
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!args || !dev) {
+		kfree(args);
+		kfree(dev);
+		return -ENOMEM;
+	}
+
+	ret = relay_parse(dev, args);
+	kfree(args);
+	if (ret) {
+		kfree(dev);
+		return ret;
+	}
+
+	ret = relay_add(dev);
+	if (ret)
+		return ret;
+
+	return count;
+}
+static CLASS_ATTR_WO(add);
+
+/* Implement write only del attribute: "relayN" */
+static ssize_t del_store(struct class *class, struct class_attribute *attr,
+		const char *buf, size_t count)
+{
+	char name[DISK_NAME_LEN];
+	int ret;
+
+	memset(name, 0, sizeof(name));
+	ret = sscanf(buf, "%31s", name);
+	if (ret != 1)
+		return -EINVAL;
+
+	ret = relay_del(name);
+	if (ret)
+		return ret;
+
+	return count;
+}
+static CLASS_ATTR_WO(del);
+
+static struct attribute *relay_class_attrs[] = {
+	&class_attr_add.attr,
+	&class_attr_del.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(relay_class);
+
+static struct class relay_class = {
+	.name = RELAY_BLKDEV_NAME,
+	.owner = THIS_MODULE,
+	.class_groups = relay_class_groups,
+};
+
+static int __init relay_init(void)
+{
+	int err;
+
+	if (io_depth < 1) {
+		printk(KERN_ERR "invalid io_depth %d\n", io_depth);
+		return -EINVAL;
+	}
+
+	relay_wq = alloc_workqueue(RELAY_BLKDEV_NAME, WQ_MEM_RECLAIM, 0);
+	if (!relay_wq) {
+		printk(KERN_ERR "alloc_workqueue: failure\n");
+		return -ENOMEM;
+	}
+
+	relay_major = register_blkdev(0, RELAY_BLKDEV_NAME);
+	if (relay_major < 0) {
+		printk(KERN_ERR "unable to register relay block device\n");
+		err = relay_major;
+		goto out_blkdev;
+	}
+
+	err = class_register(&relay_class);
+	if (err) {
+		printk(KERN_ERR "unable to register relay class\n");
+		goto out_class;
+	}
+
+	if (phys_disk) {
+		test_dev = kzalloc(sizeof(*test_dev), GFP_KERNEL);
+		if (!test_dev) {
+			err = -ENOMEM;
+			goto out_add;
+		}
+		test_dev->nr_members = 1;
+		strscpy(test_dev->members[0].path, phys_disk, RELAY_PATH_LEN);
+		err = relay_add(test_dev);
+		if (err) {
+			test_dev = NULL;
+			goto out_add;
+		}
+		if (test_bio)
+			send_test_bio(test_dev, REQ_OP_READ);
+	}
+
+	return 0;
+
+out_add:
+	class_unregister(&relay_class);
+out_class:
+	unregister_blkdev(relay_major, RELAY_BLKDEV_NAME);
+out_blkdev:
+	destroy_workqueue(relay_wq);
+	return err;
+}
+
+static void __exit relay_exit(void)
+{
+	struct relay_dev *dev, *next;
+
+	/* no more relays can be added or removed through sysfs */
+	class_unregister(&relay_class);
+
+	/* Send test write bio */
+	if (test_bio && test_dev)
+		send_test_bio(test_dev, REQ_OP_WRITE);
+
+	list_for_each_entry_safe(dev, next, &relay_devs, list) {
+		list_del(&dev->list);
+		relay_free(dev);
+	}
+	ida_destroy(&relay_ida);
+	unregister_blkdev(relay_major, RELAY_BLKDEV_NAME);
+	destroy_workqueue(relay_wq);
 }
 
 module_init(relay_init);
@@ -0,0 +1,308 @@
+/*
+ * SO2 Lab - Block device drivers (#7)
+ * Reference server for network relays (Exercise #4, #5)
+ *
+ * Serves a file or block device to relay-disk over TCP. Each connection
+ * gets its own thread, which answers the pipelined requests on it in
+ * order; a relay opens several connections to keep requests in flight
+ * in parallel.
+ *
+ *	relay-server [-p port] [-s size_mb] path
+ *
+ * With -s the file is created or resized to size_mb MiB first.
+ */
+
+#define _GNU_SOURCE			/* fallocate */
+#define _FILE_OFFSET_BITS 64	/* stores past 2 GiB under -m32 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+#include "../include/relay-net.h"
+
+#define SECTOR_SIZE		512
+#define LISTEN_BACKLOG		16
+
+static int store_fd;
+static uint64_t store_sectors;
+static uint32_t store_flags;
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int write_all(int fd, const struct iovec *iov, int nr)
+{
+	struct iovec v[2];
+	ssize_t ret;
+	int i;
+
+	memcpy(v, iov, nr * sizeof(*iov));
+	for (i = 0; i < nr; ) {
+		ret = writev(fd, v + i, nr - i);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		while (i < nr && (size_t)ret >= v[i].iov_len)
+			ret -= v[i++].iov_len;
+		if (i < nr) {
+			v[i].iov_base = (char *)v[i].iov_base + ret;
+			v[i].iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int store_io(int write, void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write ? pwrite(store_fd, buf, len, off) :
+			pread(store_fd, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return errno;
+		if (ret == 0)
+			return EIO;
+		buf = (char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+
+	return 0;
+}
+
+/* Carry out one request; returns 0 or a positive errno for the reply */
+static int handle(const struct relay_net_req *req, void *data)
+{
+	unsigned int op = be16toh(req->op);
+	unsigned int flags = be16toh(req->flags);
+	uint64_t sector = be64toh(req->sector);
+	uint32_t len = be32toh(req->len);
+	off_t off = (off_t)sector * SECTOR_SIZE;
+	int err = 0;
+
+	if (op != RELAY_NET_FLUSH && (len % SECTOR_SIZE ||
+			sector > store_sectors ||
+			len / SECTOR_SIZE > store_sectors - sector))
+		return EINVAL;
+
+	if ((flags & RELAY_NET_F_FLUSH) && fdatasync(store_fd))
+		return errno;
+
+	switch (op) {
+	case RELAY_NET_READ:
+		err = store_io(0, data, len, off);
+		break;
+	case RELAY_NET_WRITE:
+		err = store_io(1, data, len, off);
+		if (!err && (flags & RELAY_NET_F_FUA) && fdatasync(store_fd))
+			err = errno;
+		break;
+	case RELAY_NET_FLUSH:
+		if (fdatasync(store_fd))
+			err = errno;
+		break;
+	case RELAY_NET_DISCARD:
+		if (fallocate(store_fd, FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE, off, len))
+			err = errno;
+		break;
+	default:
+		err = EOPNOTSUPP;
+		break;
+	}
+
+	return err;
+}
+
+static void *serve(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	struct relay_net_hello hello = {
+		.magic		= htobe32(RELAY_NET_HELLO_MAGIC),
+		.flags		= htobe32(store_flags),
+		.nr_sectors	= htobe64(store_sectors),
+	};
+	struct relay_net_reply reply = {
+		.magic		= htobe32(RELAY_NET_REPLY_MAGIC),
+	};
+	struct relay_net_req req;
+	struct iovec iov[2];
+	unsigned int op;
+	uint32_t len;
+	void *data;
+	int err;
+
+	data = malloc(RELAY_NET_MAX_LEN);
+	if (!data)
+		goto out;
+
+	iov[0].iov_base = &hello;
+	iov[0].iov_len = sizeof(hello);
+	if (write_all(fd, iov, 1))
+		goto out;
+
+	while (!read_all(fd, &req, sizeof(req))) {
+		op = be16toh(req.op);
+		len = be32toh(req.len);
+		if (be32toh(req.magic) != RELAY_NET_REQ_MAGIC ||
+				((op == RELAY_NET_READ || op == RELAY_NET_WRITE) &&
+				 len > RELAY_NET_MAX_LEN)) {
+			fprintf(stderr, "bad request, closing connection\n");
+			break;
+		}
+		if (op == RELAY_NET_WRITE && read_all(fd, data, len))
+			break;
+
+		err = handle(&req, data);
+
+		reply.error = htobe32(err);
+		reply.tag = req.tag;
+		iov[0].iov_base = &reply;
+		iov[0].iov_len = sizeof(reply);
+		iov[1].iov_base = data;
+		iov[1].iov_len = len;
+		if (write_all(fd, iov, op == RELAY_NET_READ && !err ? 2 : 1))
+			break;
+	}
+
+out:
+	free(data);
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p port] [-s size_mb] path\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr = {
+		.sin_family	= AF_INET,
+		.sin_port	= htons(RELAY_NET_PORT),
+		.sin_addr	= { htonl(INADDR_ANY) },
+	};
+	unsigned long long size_mb = 0;
+	int sock, fd, opt, one = 1;
+	struct stat st;
+	uint64_t size;
+	pthread_t tid;
+
+	while ((opt = getopt(argc, argv, "p:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			addr.sin_port = htons(atoi(optarg));
+			break;
+		case 's':
+			size_mb = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	store_fd = open(argv[optind], O_RDWR | (size_mb ? O_CREAT : 0), 0644);
+	if (store_fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	if (size_mb && ftruncate(store_fd, size_mb << 20)) {
+		perror("ftruncate");
+		return EXIT_FAILURE;
+	}
+	if (fstat(store_fd, &st)) {
+		perror("fstat");
+		return EXIT_FAILURE;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(store_fd, BLKGETSIZE64, &size)) {
+			perror("BLKGETSIZE64");
+			return EXIT_FAILURE;
+		}
+	} else {
+		size = st.st_size;
+		/* regular files can punch holes */
+		store_flags |= RELAY_NET_HAS_DISCARD;
+	}
+	store_sectors = size / SECTOR_SIZE;
+	if (!store_sectors) {
+		fprintf(stderr, "%s is empty\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	/* a client going away must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(sock, LISTEN_BACKLOG)) {
+		perror("bind/listen");
+		return EXIT_FAILURE;
+	}
+	printf("serving %s (%llu sectors) on port %d\n", argv[optind],
+			(unsigned long long)store_sectors, ntohs(addr.sin_port));
+
+	for (;;) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return EXIT_FAILURE;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (pthread_create(&tid, NULL, serve, (void *)(intptr_t)fd)) {
+			fprintf(stderr, "pthread_create failed\n");
+			close(fd);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+
+	return EXIT_SUCCESS;
+}